@@ -22,6 +22,10 @@
 
 #include "lorawan_api/lorawan_api.h"
 
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+#include "config/config.h"
+#endif
+
 extern void test_lorawan_api_start_tx_thread( void );
 extern void test_lorawan_api_start_rx_thread( void );
 
@@ -42,6 +46,11 @@ main(int argc, char **argv)
 
     sysinit();
 
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+    /* Restore the duty cycle ledger saved before the reset */
+    conf_load();
+#endif
+
 #if MYNEWT_VAL(BUILD_INFO)
     build_info_display();
 #endif
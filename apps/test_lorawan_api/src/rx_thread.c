@@ -33,10 +33,8 @@ rx_thread(void* data)
     assert(sock_rx != 0);
 
     /* 2nd action: bind the devAddr/port */
-    for(i=1; i<=255; i++){
-        lorawan_status = lorawan_bind(sock_rx, lorawan_get_devAddr_unicast(), i);
-        assert(lorawan_status == LORAWAN_STATUS_OK);
-    }
+    lorawan_status = lorawan_bind_range(sock_rx, lorawan_get_devAddr_unicast(), 1, 255);
+    assert(lorawan_status == LORAWAN_STATUS_OK);
 
     console_printf("Wait for packet on All ports\r\n");
 
@@ -22,6 +22,9 @@ void
 tx_thread(void* data)
 {
     int ret;
+    lorawan_msg_id_t msg_id;
+    lorawan_event_t ev;
+    struct lorawan_stats stats;
 
     uint8_t port = 25;
     uint8_t payload[] = {0,1,2,3,4,5};
@@ -38,9 +41,19 @@ tx_thread(void* data)
 
     while (1) {
         /* 3rd action: put the data into the queue */
-        ret = lorawan_send(sock_tx, port, payload, sizeof(payload));
+        ret = lorawan_send_tracked(sock_tx, port, payload, sizeof(payload), &msg_id);
         console_printf("LoRaWAN API sent (%d) [with devAddr:%08lx]\r\n", ret, lorawan_get_devAddr_unicast() );
 
+        /* 4th action: wait for the completion of this message */
+        if( ret == LORAWAN_STATUS_OK ){
+            ev = lorawan_wait_msg(sock_tx, msg_id, LORAWAN_EVENT_SENT, 30000);
+            console_printf("LoRaWAN API msg %lu completed (0x%02x)\r\n", msg_id, ev);
+        }
+
+        /* The heap allocations counter must not move in steady state */
+        lorawan_get_stats(&stats);
+        console_printf("LoRaWAN API heap allocs: %lu [rx buf min free: %u]\r\n", stats.heap_allocs, stats.rx_buf.min_free);
+
         os_time_delay(10000);
     }
     assert(0);
@@ -20,6 +20,8 @@
 #ifndef __LORAWAN_API_H__
 #define __LORAWAN_API_H__
 
+#include "os/os.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -29,6 +31,11 @@ extern "C" {
  */
 typedef uint32_t lorawan_sock_t;
 
+/*
+ * Uplink message identifier type definition (0 is never a valid identifier)
+ */
+typedef uint32_t lorawan_msg_id_t;
+
 /*
  * Status type definition
  */
@@ -38,6 +45,7 @@ typedef enum {
     LORAWAN_STATUS_PORT_ALREADY_USED,
     LORAWAN_STATUS_ERROR,
     LORAWAN_STATUS_PORT_BUSY,
+    LORAWAN_STATUS_QUEUE_FULL,
 } lorawan_status_t ;
 
 /*
@@ -48,8 +56,123 @@ typedef enum {
     LORAWAN_EVENT_ACK           = 1<<1,
     LORAWAN_EVENT_SENT          = 1<<2,
     LORAWAN_EVENT_PENDING_RX    = 1<<3,
+    LORAWAN_EVENT_ERROR         = 1<<4,
+    LORAWAN_EVENT_EXPIRED       = 1<<5,
+    LORAWAN_EVENT_DROPPED       = 1<<6,
+    LORAWAN_EVENT_UNKNOWN       = 1<<7,
 } lorawan_event_t ;
 
+/*
+ * Uplink priority classes of a socket (see lorawan_set_priority())
+ */
+#define LORAWAN_PRIO_HIGHEST    0
+#define LORAWAN_PRIO_DEFAULT    4
+#define LORAWAN_PRIO_LOWEST     7
+
+/*
+ * Uplink queue policies of a socket (see lorawan_set_queue_policy())
+ */
+#define LORAWAN_QUEUE_FIFO      0
+#define LORAWAN_QUEUE_REPLACE   (1<<0)      /* a new message replaces the unsent one of the same port */
+#define LORAWAN_QUEUE_TTL       (1<<1)      /* a message queued for longer than the TTL is dropped */
+
+/*
+ * Poll request definition (see lorawan_poll())
+ */
+struct lorawan_pollfd {
+    lorawan_sock_t sock;        /* socket to watch (0 = ignored entry) */
+    lorawan_event_t events;     /* requested events */
+    lorawan_event_t revents;    /* returned events */
+};
+
+/*
+ * Payload piece definition (see lorawan_sendv())
+ */
+struct lorawan_iovec {
+    const uint8_t* base;
+    uint8_t len;
+};
+
+/*
+ * Received packet buffer definition (see lorawan_recv_buf())
+ */
+struct lorawan_rx_buf {
+    /* Packet informations (read-only) */
+    uint32_t devAddr;
+    uint8_t port;
+    uint8_t size;
+    uint8_t* payload;
+    int16_t rssi;
+    int8_t snr;
+    uint8_t multicast;
+    uint32_t downlink_counter;
+
+    /* Private fields */
+    struct os_event ev;
+    lorawan_sock_t sock;
+    uint8_t refcnt;
+};
+
+/*
+ * Static pool statistics definition
+ */
+struct lorawan_pool_stats {
+    uint16_t blocks;            /* size of the pool */
+    uint16_t free;              /* blocks currently free */
+    uint16_t min_free;          /* lowest number of free blocks since init */
+};
+
+/*
+ * Duty cycle budget of the band carrying the next uplink (see lorawan_get_tx_budget())
+ * The budget of a band is its duty cycle over one hour (e.g. 36s for 1%), refilled continuously.
+ */
+struct lorawan_tx_budget {
+    uint8_t band;               /* band of the region */
+    uint32_t used_ms;           /* airtime consumed (not refilled yet) */
+    uint32_t remaining_ms;      /* airtime still available */
+    uint32_t airtime_ms;        /* time on air of the frame */
+    uint32_t wait_ms;           /* delay before the frame can leave (0: now) */
+};
+
+/*
+ * Airtime statistics of a socket (see lorawan_get_sock_stats())
+ */
+struct lorawan_sock_stats {
+    uint32_t frames;            /* uplinks sent by the socket (aggregated frames count once) */
+    uint32_t airtime_ms;        /* time on air of these uplinks, retransmissions included */
+    uint8_t weight;             /* fair share weight */
+    uint32_t quota_ms;          /* airtime allowed per hour (0: no quota) */
+    uint32_t quota_used_ms;     /* airtime of the quota consumed (not refilled yet) */
+    uint32_t expired;           /* messages dropped on their deadline */
+    uint32_t ttl_drops;         /* messages dropped on the TTL (LORAWAN_QUEUE_TTL) */
+    uint32_t replaced;          /* messages replaced by a newer one (LORAWAN_QUEUE_REPLACE) */
+};
+
+/*
+ * LoRaWAN statistics definition (see lorawan_get_stats())
+ */
+struct lorawan_stats {
+    struct lorawan_pool_stats rx_buf;       /* downlink buffers */
+    struct lorawan_pool_stats multicast;    /* multicast parameters */
+    struct lorawan_pool_stats timer;        /* stack timers */
+    uint32_t rx_drop_no_buf;                /* downlinks dropped because no buffer was free */
+    uint32_t irq_overflows;                 /* radio IRQ edges whose timestamp was lost */
+    uint32_t radio_busy_timeouts;           /* radio commands not answered (SX126x BUSY line stuck high) */
+    uint32_t heap_allocs;                   /* heap allocations of the whole firmware (LORAWAN_HEAP_TRACE only) */
+};
+
+/*
+ * Rx callback type definition (see lorawan_set_callbacks())
+ *   - The buffer is given back to the pool when the callback returns,
+ *     unless the callback takes a reference with lorawan_buf_retain().
+ */
+typedef void (*lorawan_rx_cb_t)(lorawan_sock_t sock, struct lorawan_rx_buf* buf, void* arg);
+
+/*
+ * Tx completion callback type definition (see lorawan_set_callbacks())
+ */
+typedef void (*lorawan_tx_done_cb_t)(lorawan_sock_t sock, lorawan_msg_id_t msg_id, lorawan_event_t ev, void* arg);
+
 
 /*******************************************************/
 /*                                                     */
@@ -93,25 +216,191 @@ int lorawan_close(lorawan_sock_t socket_id);
 
 /*
  * Put a LoRaWAN message in the queue.
- * return: the result of the action.
+ *   - The payload is copied into the socket queue: the buffer can be reused as soon as the function returns.
+ *   - The message is sent by the LoRaWAN task as soon as the MAC is idle.
+ * return: the result of the action (LORAWAN_STATUS_QUEUE_FULL if no more message can be queued on the socket).
  * ( Non-blocking function )
  */
 lorawan_status_t lorawan_send(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size);
 
+/*
+ * Same as lorawan_send(), but also give the identifier of the queued message (msg_id can be NULL).
+ *   - The identifier allows to wait the completion of this message with lorawan_wait_msg().
+ * return: the result of the action.
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_send_tracked(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size, lorawan_msg_id_t* msg_id);
+
+/*
+ * Same as lorawan_send_tracked(), with a payload made of several pieces (msg_id can be NULL).
+ *   - The pieces are gathered directly into the socket queue: no intermediate buffer is needed.
+ * return: the result of the action (LORAWAN_STATUS_ERROR if the total size is too big).
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_sendv(lorawan_sock_t sock, uint8_t port, const struct lorawan_iovec* iov, uint8_t iovcnt, lorawan_msg_id_t* msg_id);
+
+/*
+ * Same as lorawan_send_tracked(), with the payload in an mbuf chain (msg_id can be NULL).
+ *   - The chain is copied into the socket queue: it stays owned by the caller.
+ * return: the result of the action (LORAWAN_STATUS_ERROR if the chain is too big).
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_send_mbuf(lorawan_sock_t sock, uint8_t port, struct os_mbuf* om, lorawan_msg_id_t* msg_id);
+
+/*
+ * Enable (max_delay_ms != 0) or disable (max_delay_ms = 0) the aggregation of the messages sent on a port of the socket.
+ *   - The queued messages of the port are packed in one frame, up to the max payload of the current datarate.
+ *   - Each message is framed as: 1 byte length + payload (the receiver must split the frame).
+ *   - A message too big to be framed at the current datarate (payload_size + 1 > max payload) is sent alone, unframed.
+ *   - A frame is sent when it is full, or when its oldest message has waited max_delay_ms.
+ *   - Each port has its own delay: calling it again for a port only changes the delay of this port.
+ *   - Up to LORAWAN_AGGR_PORT_MAX ports of a socket can be aggregated (LORAWAN_STATUS_ERROR beyond).
+ *   - Each message keeps its own identifier / completion events.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_aggregation(lorawan_sock_t sock, uint8_t port, uint32_t max_delay_ms);
+
+/*
+ * Set the priority class of the uplinks of a socket (LORAWAN_PRIO_HIGHEST..LORAWAN_PRIO_LOWEST).
+ *   - The scheduler sends the message of the highest class first, then the one with the earliest deadline,
+ *     then the oldest one.
+ *   - A queued message gains one class each LORAWAN_TX_AGING_MS: no message is starved.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_priority(lorawan_sock_t sock, uint8_t prio);
+
+/*
+ * Set the fair share weight of a socket (1..255, default 1).
+ *   - Among messages of the same class and deadline, the socket which used the least airtime
+ *     relative to its weight is served first.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_weight(lorawan_sock_t sock, uint8_t weight);
+
+/*
+ * Set a hard airtime quota on a socket: quota_ms of time on air per hour, refilled continuously
+ * (token bucket, 0 = no quota).
+ *   - The messages of a socket over its quota are held in its queue until the quota is refilled.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_quota(lorawan_sock_t sock, uint32_t quota_ms);
+
+/*
+ * Set the queue policies of the uplinks of a socket (LORAWAN_QUEUE_* flags, for state-type data):
+ *   - LORAWAN_QUEUE_REPLACE: an unsent message is replaced by a newer one of the same port, which takes
+ *     its place in the schedule. The replaced message completes with LORAWAN_EVENT_DROPPED.
+ *     The replace is done by lorawan_send*(), so a burst on the port does not fill the queue.
+ *   - LORAWAN_QUEUE_TTL: a message still queued ttl_ms after lorawan_send*() is dropped before reaching
+ *     the MAC. It completes with LORAWAN_EVENT_EXPIRED.
+ * Both are counted in lorawan_get_sock_stats().
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_queue_policy(lorawan_sock_t sock, uint8_t policy, uint32_t ttl_ms);
+
+/*
+ * Get the airtime statistics of a socket.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_get_sock_stats(lorawan_sock_t sock, struct lorawan_sock_stats* stats);
+
+/*
+ * Same as lorawan_send_tracked(), with a deadline (msg_id can be NULL).
+ *   - If the message is still queued deadline_ms after this call, it is dropped and
+ *     LORAWAN_EVENT_EXPIRED is reported.
+ *   - Among the messages of a class, the earliest deadline is sent first (even before older messages
+ *     of the same socket, except on aggregated ports).
+ * return: the result of the action.
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_send_deadline(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size,
+                                       uint32_t deadline_ms, lorawan_msg_id_t* msg_id);
+
+/*
+ * Allow the current thread to wait an event from a specific message of the socket.
+ *   - LORAWAN_EVENT_SENT / LORAWAN_EVENT_ACK are reported when the McpsConfirm of the message is received.
+ *   - LORAWAN_EVENT_ERROR is reported if the message can not be sent.
+ *   - LORAWAN_EVENT_EXPIRED is reported if the deadline (or TTL) of the message is passed before it is sent.
+ *   - LORAWAN_EVENT_DROPPED is reported if the message is replaced by a newer one (LORAWAN_QUEUE_REPLACE).
+ *   - The function also returns when the message is completed without the expected event (e.g. no ACK).
+ *   - LORAWAN_EVENT_UNKNOWN is returned if the message is too old: only the last LORAWAN_TX_QUEUE_LEN
+ *     completions of the socket are recorded.
+ *   - Several tasks can wait on the same socket (e.g. on different messages).
+ *   - timeout_ms=0 means wait forever.
+ * return: the completion events of the message. LORAWAN_EVENT_NONE if timeout occurs.
+ * ( Blocking function )
+ */
+lorawan_event_t lorawan_wait_msg(lorawan_sock_t sock, lorawan_msg_id_t msg_id, lorawan_event_t ev, uint32_t timeout_ms);
+
 /*
  * Allow the current thread to wait an event from the previous Tx.
- * return: the unlock cause
+ *   - Same as lorawan_wait_msg() on the last message queued on the socket.
+ *   - If LORAWAN_EVENT_PENDING_RX is requested, the function also returns when a packet is received on the socket.
+ * return: the unlock cause. LORAWAN_EVENT_NONE if timeout occurs.
  * ( Blocking function )
  */
 lorawan_event_t lorawan_wait_ev(lorawan_sock_t sock, lorawan_event_t ev, uint32_t timeout_ms);
 
 /*
  * Allow the current thread to query the state of a socket (same as the lorawan_wait_ev(), but non-blocking)
- * return: the last known state
+ * return: the events of the last completed message, with LORAWAN_EVENT_PENDING_RX if packets are waiting in the socket.
  * ( Non-blocking function )
  */
 lorawan_event_t lorawan_get_state(lorawan_sock_t sock);
 
+/*
+ * Estimate the time on air of a message sent now on the socket (current datarate of the ADR,
+ * or the datarate of the socket), before sending it.
+ * return: the time on air in ms / 0 if the socket or the datarate is invalid
+ * ( Non-blocking function )
+ */
+uint32_t lorawan_estimate_airtime(lorawan_sock_t sock, uint8_t payload_size);
+
+/*
+ * Get the duty cycle budget for a message sent now on the socket, and the earliest time it can leave.
+ * The Tx queue holds the messages until their band allows them (no error is reported).
+ * With LORAWAN_DC_PERSIST, the ledger is saved with sys/config: the application must call conf_load()
+ * after sysinit() to restore it.
+ * return: LORAWAN_STATUS_ERROR if the socket is invalid or the region has no duty cycle (e.g. US915)
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_get_tx_budget(lorawan_sock_t sock, uint8_t payload_size, struct lorawan_tx_budget* budget);
+
+/*
+ * Allow the current thread to wait events on several sockets at once.
+ *   - LORAWAN_EVENT_PENDING_RX is reported as long as packets are waiting in the socket (read them with lorawan_recv()).
+ *   - The completion events (LORAWAN_EVENT_SENT / ACK / ERROR / EXPIRED / DROPPED) are the ones of all the messages
+ *     completed since the previous lorawan_poll() on the socket, merged: use lorawan_wait_msg() or on_tx_done
+ *     to get the events of each message.
+ *   - Only one task at a time can poll a given socket.
+ *   - timeout_ms=0 means wait forever.
+ * return: the number of entries with revents set. 0 if timeout occurs. -1 if a socket is invalid.
+ * ( Blocking function )
+ */
+int lorawan_poll(struct lorawan_pollfd* fds, uint8_t nfds, uint32_t timeout_ms);
+
+/*
+ * Register callbacks on the socket, as an alternative to the blocking functions (NULL = no callback).
+ *   - on_rx is called for each received packet: the packet is not queued in the socket, lorawan_recv() won't see it.
+ *   - on_tx_done is called with the completion events of each message sent on the socket.
+ *   - The callbacks run on the LoRaWAN task (see lorawan_set_callback_evq()): they must be short and must not block.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_callbacks(lorawan_sock_t sock, lorawan_rx_cb_t on_rx, lorawan_tx_done_cb_t on_tx_done, void* arg);
+
+/*
+ * Select the event queue on which the callbacks of the socket run (NULL = the LoRaWAN task, the default).
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_set_callback_evq(lorawan_sock_t sock, struct os_eventq* evq);
+
 
 /*******************************************************/
 /*                                                     */
@@ -129,6 +418,16 @@ lorawan_event_t lorawan_get_state(lorawan_sock_t sock);
  */
 lorawan_status_t lorawan_bind(lorawan_sock_t sock, uint32_t devAddr, uint8_t port);
 
+/*
+ * Bind all the ports from first_port to last_port (included) to the socket, in one call.
+ *   - Same rules as lorawan_bind().
+ *   - Nothing is bound if one of the ports is already bound.
+ *   - lorawan_bind_range(sock, devAddr, 1, 255) binds all the application ports of the devAddr.
+ * return: status of the operation
+ * ( Non-blocking function )
+ */
+lorawan_status_t lorawan_bind_range(lorawan_sock_t sock, uint32_t devAddr, uint8_t first_port, uint8_t last_port);
+
 /*
  * Wait for a packet on a specific socket.
  *   - devAddr / port / payload fields will be filled with the received data if it is valid.
@@ -137,9 +436,38 @@ lorawan_status_t lorawan_bind(lorawan_sock_t sock, uint32_t devAddr, uint8_t por
  */
 uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint8_t* payload, uint8_t payload_max_len, uint32_t timeout_ms);
 
+/*
+ * Wait for a packet on a specific socket, without copy.
+ *   - The buffer is the one filled by the LoRaWAN stack: its payload must not be modified.
+ *   - The buffer must be given back with lorawan_buf_release() as soon as possible,
+ *     because the pool of downlink buffers is shared by all sockets.
+ * return: the received buffer. NULL if timeout occurs.
+ * ( Blocking function )
+ */
+struct lorawan_rx_buf* lorawan_recv_buf(lorawan_sock_t sock, uint32_t timeout_ms);
+
+/*
+ * Take one more reference on a received buffer (e.g. to give it to another task).
+ * Each reference must be given back with lorawan_buf_release().
+ */
+void lorawan_buf_retain(struct lorawan_rx_buf* buf);
+
+/*
+ * Give back a reference on a received buffer: the buffer returns to the pool with its last reference.
+ */
+void lorawan_buf_release(struct lorawan_rx_buf* buf);
+
 //TODO: need a function to get packet informations (rssi/snr/fei...)
 
 
+/*
+ * Get the statistics of the static pools used by the LoRaWAN stack.
+ *   - heap_allocs must stay constant once the application is initialized:
+ *     the LoRaWAN stack never allocates from the heap.
+ */
+void lorawan_get_stats(struct lorawan_stats* stats);
+
+
 /*******************************************************/
 /*                                                     */
 /*              ACCESSOR FUNCTIONS                     */
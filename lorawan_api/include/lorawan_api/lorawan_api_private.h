@@ -29,20 +29,290 @@ extern "C" {
 
 #define LORAWAN_TASK_PRIO       MYNEWT_VAL(LORAWAN_TASK_PRIO)
 #define LORAWAN_STACK_SIZE      MYNEWT_VAL(LORAWAN_STACK_SIZE)
+#define LORAWAN_SOCKET_MAX      MYNEWT_VAL(LORAWAN_SOCKET_MAX)
+#define LORAWAN_MULTICAST_MAX   MYNEWT_VAL(LORAWAN_MULTICAST_MAX)
+#define LORAWAN_DEMUX_SIZE      ( LORAWAN_MULTICAST_MAX + 1 )
+#define LORAWAN_RX_BUF_COUNT    MYNEWT_VAL(LORAWAN_RX_BUF_COUNT)
+#define LORAWAN_RX_PAYLOAD_MAX  MYNEWT_VAL(LORAWAN_RX_PAYLOAD_MAX)
+#define LORAWAN_TX_QUEUE_LEN    MYNEWT_VAL(LORAWAN_TX_QUEUE_LEN)
+#define LORAWAN_TX_PAYLOAD_MAX  MYNEWT_VAL(LORAWAN_TX_PAYLOAD_MAX)
+#define LORAWAN_TX_RETRY_MS     MYNEWT_VAL(LORAWAN_TX_RETRY_MS)
+#define LORAWAN_TX_AGING_MS     MYNEWT_VAL(LORAWAN_TX_AGING_MS)
+#define LORAWAN_AGGR_PORT_MAX   MYNEWT_VAL(LORAWAN_AGGR_PORT_MAX)
+#define LORAWAN_DC_SAVE_PERIOD_S MYNEWT_VAL(LORAWAN_DC_SAVE_PERIOD_S)
+
+/* Max LoRaWAN application payload, whatever the region / datarate */
+#define LORAWAN_AGGR_FRAME_MAX  242
+
+#if LORAWAN_TX_PAYLOAD_MAX >= LORAWAN_AGGR_FRAME_MAX
+#error "LORAWAN_TX_PAYLOAD_MAX must be lower than 242: an aggregated message takes 1 more byte"
+#endif
+
+/* PHY overhead of an uplink without FOpts: MHDR (1) + FHDR (7) + FPort (1) + MIC (4) */
+#define LORAWAN_FRAME_OVERHEAD  13
+
+//TODO: never defined in another place ?
+#define MIN( a, b ) ( ( ( a ) < ( b ) ) ? ( a ) : ( b ) )
+
+#if LORAWAN_SOCKET_MAX > 255
+#error "LORAWAN_SOCKET_MAX must not exceed 255"
+#endif
+
+/*
+ * A socket identifier is the index of the socket in the socket table (8 LSB),
+ * and the generation of this table entry (24 MSB). The generation is increased
+ * each time the entry is reused, so that a stale identifier is rejected.
+ */
+#define LORAWAN_SOCK_IDX(sock)          ( (sock) & 0xFF )
+#define LORAWAN_SOCK_GEN(sock)          ( (sock) >> 8 )
+#define LORAWAN_SOCK_MAKE(idx, gen)     ( ( (lorawan_sock_t)(gen) << 8 ) | (idx) )
+
+/*
+ * Port bitmap helper (uint32_t[8] bitmaps)
+ */
+#define LORAWAN_PORT_IS_SET(bitmap, port)   ( ( (bitmap)[(port)/32] & (1UL<<((port)%32)) ) != 0 )
+
+/*!
+ * Queued uplink message structure definition
+ */
+struct tx_msg {
+    uint32_t seq;
+    uint32_t id;
+    os_time_t time;                             /* time of the enqueue (TTL, aggregation delay) */
+    os_time_t aging_time;                       /* start of the aging: enqueue of the oldest message replaced */
+    os_time_t deadline;                         /* drop time (in ticks), if has_deadline */
+    bool has_deadline;
+    uint8_t port;
+    uint8_t size;
+    uint8_t payload[LORAWAN_TX_PAYLOAD_MAX];
+    STAILQ_ENTRY(tx_msg) tm_next;
+};
+
+/*!
+ * Completed uplink message structure definition
+ */
+struct tx_done {
+    uint32_t id;
+    lorawan_event_t ev;
+};
+
+/*!
+ * Task blocked in lorawan_wait_*() on a socket (the semaphore is on the stack of the task)
+ */
+struct lorawan_waiter {
+    struct os_sem sem;                          /* released on each event of the socket */
+    SLIST_ENTRY(lorawan_waiter) next;
+};
+
+/*!
+ * Aggregation setting of a port
+ */
+struct lorawan_aggr {
+    uint8_t port;
+    os_time_t delay;                            /* max delay of an aggregated message (in ticks), 0 = entry free */
+};
 
 /*!
- * Socket list structure definition
+ * Socket table entry definition
  */
 struct sock_el {
-    lorawan_sock_t sock;
+    lorawan_sock_t sock;        /* 0 if the entry is free */
+    uint32_t gen;
+    uint8_t reserved;
     McpsReq_t mcps_req;
-    McpsIndication_t mcps_ind;
     uint32_t devAddr;//TODO: on first implementation, allow only one devAddr by socket.
     uint32_t ports[8];
     struct os_eventq sock_eventq;
-    SLIST_ENTRY(sock_el) sc_next;
+    struct tx_msg tx_msgs[LORAWAN_TX_QUEUE_LEN];
+    STAILQ_HEAD(, tx_msg) tx_free;
+    STAILQ_HEAD(, tx_msg) tx_pending;
+    uint32_t tx_next_id;
+    uint32_t tx_last_id;                        /* last message queued on the socket */
+    struct tx_done tx_done[LORAWAN_TX_QUEUE_LEN];  /* last completed messages */
+    uint8_t tx_done_idx;
+    lorawan_event_t state;                      /* events of the last completed message */
+    SLIST_HEAD(, lorawan_waiter) waiters;       /* tasks blocked in lorawan_wait_*() */
+    lorawan_event_t poll_ev;                    /* completion events not yet reported by lorawan_poll() */
+    struct os_sem* poll_sem;                    /* semaphore of the task blocked in lorawan_poll(), if any */
+    lorawan_rx_cb_t on_rx;
+    lorawan_tx_done_cb_t on_tx_done;
+    void* cb_arg;
+    struct os_eventq* cb_evq;                   /* NULL = callbacks run on the LoRaWAN task */
+    struct os_event tx_cb_ev;
+    uint8_t tx_cb_idx;                          /* next completion to report to on_tx_done */
+    uint32_t aggr_ports[8];                     /* ports with aggregation enabled */
+    struct lorawan_aggr aggr[LORAWAN_AGGR_PORT_MAX];  /* delay of each port of aggr_ports */
+    uint8_t prio;                               /* priority class of the uplinks */
+    uint8_t weight;                             /* fair share weight */
+    uint32_t vtime;                             /* airtime / weight (fair share order) */
+    uint32_t tx_frames;                         /* uplinks sent */
+    uint32_t tx_airtime;                        /* time on air of the uplinks (in ms) */
+    uint32_t quota;                             /* airtime per hour (in ms), 0 = no quota */
+    uint32_t quota_used;                        /* airtime in the quota bucket (in ms) */
+    uint64_t quota_last;                        /* last refill of the quota bucket (in ms) */
+    uint8_t queue_policy;                       /* LORAWAN_QUEUE_* */
+    os_time_t ttl;                              /* max queuing time (in ticks) of LORAWAN_QUEUE_TTL */
+    uint32_t tx_expired;                        /* messages dropped on their deadline */
+    uint32_t tx_ttl_drops;                      /* messages dropped on the TTL */
+    uint32_t tx_replaced;                       /* messages replaced by a newer one */
 };
 
+/*
+ * Socket table
+ */
+extern struct sock_el l_sock_table[LORAWAN_SOCKET_MAX];
+
+/*
+ * Key cache owners of the unicast session keys (see aes_key_cache_set)
+ */
+#define LORAWAN_KEY_NWKS    0
+#define LORAWAN_KEY_APPS    1
+extern uint8_t l_unicast_keys[2];
+
+/*
+ * Find the socket table entry matching with a socket identifier
+ * return: the entry / NULL if the identifier is invalid or stale
+ */
+struct sock_el* _lorawan_find_el(lorawan_sock_t sock);
+
+/*!
+ * Downlink demultiplexing entry: one for the unicast devAddr, and one for each multicast devAddr
+ */
+struct demux_el {
+    uint32_t devAddr;
+    uint16_t nb_ports;          /* 0 if the entry is free */
+    uint8_t port_sock[256];     /* index+1 of the socket bound on each port, 0 if the port is not bound */
+};
+
+/*
+ * Bind all the ports from first_port to last_port of a devAddr to the socket.
+ * Nothing is bound if one of the ports is already bound.
+ */
+lorawan_status_t _lorawan_demux_bind(struct sock_el* sock_el, uint32_t devAddr, uint8_t first_port, uint8_t last_port);
+
+/*
+ * Remove all the bindings of the socket
+ */
+void _lorawan_demux_unbind(struct sock_el* sock_el);
+
+/*
+ * Find the socket bound on a devAddr/port
+ * return: the socket / NULL if no match
+ */
+struct sock_el* _lorawan_demux_find(uint32_t devAddr, uint8_t port);
+
+/*
+ * Give back a received buffer to the pool
+ */
+void _lorawan_rx_buf_free(struct lorawan_rx_buf* buf);
+
+/*
+ * Initialize the Tx queue of a new socket
+ */
+void _lorawan_tx_init(struct sock_el* sock_el);
+
+/*
+ * Take a free slot of the socket Tx queue (NULL if the queue is full).
+ * The slot is owned by the caller until _lorawan_tx_commit() or _lorawan_tx_abort().
+ */
+struct tx_msg* _lorawan_tx_alloc(struct sock_el* sock_el);
+
+/*
+ * Give back a slot taken with _lorawan_tx_alloc(), without sending it
+ */
+void _lorawan_tx_abort(struct sock_el* sock_el, struct tx_msg* msg);
+
+/*
+ * Queue a slot filled by the caller (port/size/payload), and wake up the scheduler
+ */
+void _lorawan_tx_commit(struct sock_el* sock_el, struct tx_msg* msg, uint32_t* msg_id);
+
+/*
+ * Get / give back a multicast parameters block from the static pool
+ */
+MulticastParams_t* _lorawan_mcast_alloc(void);
+void _lorawan_mcast_free(MulticastParams_t* mcast_param);
+
+/*
+ * Fill the statistics of the pools owned by the LoRaWAN API
+ */
+void _lorawan_stats_get(struct lorawan_stats* stats);
+
+/*
+ * Wake up the Tx scheduler (e.g. after a change of the socket Tx parameters)
+ */
+void _lorawan_tx_kick(void);
+
+/*
+ * Precompute the payload keystream of the next uplink, when the MAC is idle
+ */
+void _lorawan_tx_prepare(void);
+
+/*
+ * Time on air of an uplink at a datarate of the active region (integer arithmetic)
+ * return: in ms, 0 if the datarate is not a LoRa one
+ */
+uint32_t _lorawan_airtime_ms(int8_t dr, uint8_t payload_size);
+
+/*
+ * Datarate of the next uplink of a socket (ADR datarate, or the one of the socket)
+ */
+int8_t _lorawan_tx_datarate(struct sock_el* sock_el);
+
+/*
+ * Region given to the MAC (first active one)
+ */
+LoRaMacRegion_t _lorawan_region(void);
+
+/*
+ * Initialize the airtime share of a new socket (fair share position, no quota)
+ */
+void _lorawan_share_init(struct sock_el* sock_el);
+
+/*
+ * Refill the quota bucket of a socket
+ */
+void _lorawan_quota_refill(struct sock_el* sock_el);
+
+/*
+ * Duty cycle ledger (lorawan_api_dc.c)
+ */
+void _lorawan_dc_init(void);
+
+/*
+ * Account an uplink: airtime (in ms) sent nb_tx times on a channel
+ */
+void _lorawan_dc_consume(uint8_t channel, uint32_t airtime_ms, uint8_t nb_tx);
+
+/*
+ * Delay before a frame can be sent on one of the enabled bands
+ * return: in ms, 0 if it can be sent now
+ */
+uint32_t _lorawan_dc_wait_ms(uint32_t airtime_ms);
+
+/*
+ * Budget of the band that will carry a frame (the first one available)
+ * return: false if there is no ledger for the region
+ */
+bool _lorawan_dc_budget(uint32_t airtime_ms, struct lorawan_tx_budget* budget);
+
+/*
+ * Copy a message into the Tx queue of the socket, and wake up the scheduler
+ */
+lorawan_status_t _lorawan_tx_enqueue(struct sock_el* sock_el, uint8_t port, uint8_t* payload, uint8_t payload_size,
+                                     uint32_t deadline_ms, uint32_t* msg_id);
+
+/*
+ * Report the pending Tx completions to the on_tx_done callback of the socket (ev_arg = sock_el)
+ */
+void _lorawan_tx_cb_ev(struct os_event* ev);
+
+/*
+ * Get the completion events of a message (LORAWAN_EVENT_NONE while it is not completed,
+ * LORAWAN_EVENT_UNKNOWN if its completion is no longer recorded)
+ */
+lorawan_event_t _lorawan_tx_state(struct sock_el* sock_el, uint32_t msg_id);
+
 
 #ifdef __cplusplus
 }
@@ -29,12 +29,7 @@
 #include "hal/hal_bsp.h"
 
 #include "queue-board.h"
-
-//TODO: never defined in another place ?
-#define MIN( a, b ) ( ( ( a ) < ( b ) ) ? ( a ) : ( b ) )
-
-extern struct sock_el* _lorawan_find_el(lorawan_sock_t sock);
-extern SLIST_HEAD(s_socket, sock_el) l_sock_list;
+#include "board-utils.h"
 
 
 /*
@@ -51,21 +46,32 @@ static void _lorawan_init_mcps(McpsReq_t* mcps_req){
  */
 lorawan_sock_t lorawan_socket(void)
 {
-    static uint32_t sock_cpt = 1;
-    struct sock_el* sock_el;
+    struct sock_el* sock_el = NULL;
+    uint32_t gen;
+    os_sr_t sr;
+    int i;
 
-    /* Allocate one element on the list */
-    sock_el = malloc( sizeof(struct sock_el) );
+    /* Reserve one free entry of the socket table */
+    OS_ENTER_CRITICAL(sr);
+    for(i=0; i<LORAWAN_SOCKET_MAX; i++){
+        if( l_sock_table[i].reserved == 0 ){
+            sock_el = &l_sock_table[i];
+            sock_el->reserved = 1;
+            break;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
 
     if(sock_el == NULL)
         return 0;
 
-    /* Clean the socket */
+    /* Clean the socket, but keep the generation of the entry */
+    gen = ( sock_el->gen + 1 ) & 0x00FFFFFF;
+    if( gen == 0 )
+        gen = 1; // the identifier must never be 0
     memset(sock_el, 0, sizeof(struct sock_el));
-
-    /* Create a unique sock id */
-    sock_el->sock = sock_cpt;
-    sock_cpt++;
+    sock_el->gen = gen;
+    sock_el->reserved = 1;
 
     /* Initialize MCPS_req to the default values */
     _lorawan_init_mcps(&(sock_el->mcps_req));
@@ -73,7 +79,16 @@ lorawan_sock_t lorawan_socket(void)
     /* Init the event queue on this socket */
     os_eventq_init(&(sock_el->sock_eventq));
 
-    SLIST_INSERT_HEAD(&l_sock_list, sock_el, sc_next);
+    /* Init the Tx queue on this socket */
+    _lorawan_tx_init(sock_el);
+    sock_el->prio = LORAWAN_PRIO_DEFAULT;
+    _lorawan_share_init(sock_el);
+    SLIST_INIT(&(sock_el->waiters));
+    sock_el->tx_cb_ev.ev_cb = _lorawan_tx_cb_ev;
+    sock_el->tx_cb_ev.ev_arg = sock_el;
+
+    /* Finally publish the socket identifier: the socket can now be found */
+    sock_el->sock = LORAWAN_SOCK_MAKE(i, sock_el->gen);
     return sock_el->sock;
 }
 
@@ -85,6 +100,7 @@ lorawan_sock_t lorawan_socket(void)
 int lorawan_close(lorawan_sock_t socket_id)
 {
     struct sock_el* p_sock_el;
+    os_sr_t sr;
     p_sock_el = _lorawan_find_el(socket_id);
 
     if( p_sock_el == NULL )
@@ -94,11 +110,22 @@ int lorawan_close(lorawan_sock_t socket_id)
     if( !( STAILQ_EMPTY( &(p_sock_el->sock_eventq.evq_list) ) ) )
         return -2;//TODO: perhaps automatically remove all pending ev + free them ?
 
-    /* Remove the event queue from the socket list */
-    SLIST_REMOVE(&l_sock_list, p_sock_el, sock_el, sc_next);
+    /* Check that all the queued messages have been sent */
+    if( !( STAILQ_EMPTY( &(p_sock_el->tx_pending) ) ) )
+        return -2;
 
-    /* Finally free the socket */
-    free(p_sock_el);
+    /* Remove all the devAddr/port bindings */
+    _lorawan_demux_unbind(p_sock_el);
+
+    /* Forget the completions not yet reported to the callback */
+    if( p_sock_el->cb_evq != NULL )
+        os_eventq_remove(p_sock_el->cb_evq, &(p_sock_el->tx_cb_ev));
+
+    /* Finally release the entry: the identifier becomes stale */
+    OS_ENTER_CRITICAL(sr);
+    p_sock_el->sock = 0;
+    p_sock_el->reserved = 0;
+    OS_EXIT_CRITICAL(sr);
 
     return 0;
 }
@@ -110,7 +137,6 @@ int lorawan_close(lorawan_sock_t socket_id)
  */
 lorawan_status_t lorawan_send(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size)
 {
-    LoRaMacStatus_t status = LORAMAC_STATUS_PARAMETER_INVALID;
     struct sock_el* sock_el = _lorawan_find_el(sock);
     if( sock_el == NULL )
         return LORAWAN_STATUS_INVALID_SOCK;
@@ -118,24 +144,330 @@ lorawan_status_t lorawan_send(lorawan_sock_t sock, uint8_t port, uint8_t* payloa
     //TODO: not sure that we should reconfigure all of these mibReq on each Tx.
     //LoRaMacMibSetRequestConfirm( &mibReq );
 
-    //TODO: do not send immediately the message, but put it into the queue
-    if(sock_el->mcps_req.Type == MCPS_UNCONFIRMED){
-        sock_el->mcps_req.Req.Unconfirmed.fBuffer = payload;
-        sock_el->mcps_req.Req.Unconfirmed.fBufferSize = payload_size;
-        sock_el->mcps_req.Req.Unconfirmed.fPort = port;
-        status = LoRaMacMcpsRequest( &(sock_el->mcps_req) );
+    return _lorawan_tx_enqueue(sock_el, port, payload, payload_size, 0, NULL);
+}
+
+lorawan_status_t lorawan_send_tracked(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size, lorawan_msg_id_t* msg_id)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    return _lorawan_tx_enqueue(sock_el, port, payload, payload_size, 0, msg_id);
+}
+
+lorawan_status_t lorawan_send_deadline(lorawan_sock_t sock, uint8_t port, uint8_t* payload, uint8_t payload_size,
+                                       uint32_t deadline_ms, lorawan_msg_id_t* msg_id)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    if( deadline_ms == 0 )
+        return LORAWAN_STATUS_ERROR;
+
+    return _lorawan_tx_enqueue(sock_el, port, payload, payload_size, deadline_ms, msg_id);
+}
+
+lorawan_status_t lorawan_sendv(lorawan_sock_t sock, uint8_t port, const struct lorawan_iovec* iov, uint8_t iovcnt, lorawan_msg_id_t* msg_id)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    struct tx_msg* msg;
+    uint16_t size = 0;
+    int i;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    for(i=0; i<iovcnt; i++)
+        size += iov[i].len;
+    if( size > LORAWAN_TX_PAYLOAD_MAX )
+        return LORAWAN_STATUS_ERROR;
+
+    msg = _lorawan_tx_alloc(sock_el);
+    if( msg == NULL )
+        return LORAWAN_STATUS_QUEUE_FULL;
+
+    /* Gather the pieces into the slot */
+    msg->port = port;
+    msg->size = 0;
+    for(i=0; i<iovcnt; i++){
+        memcpy(&(msg->payload[msg->size]), iov[i].base, iov[i].len);
+        msg->size += iov[i].len;
     }
-    else if(sock_el->mcps_req.Type == MCPS_CONFIRMED){
-        sock_el->mcps_req.Req.Confirmed.fBuffer = payload;
-        sock_el->mcps_req.Req.Confirmed.fBufferSize = payload_size;
-        sock_el->mcps_req.Req.Confirmed.fPort = port;
-        status = LoRaMacMcpsRequest( &(sock_el->mcps_req) );
+
+    _lorawan_tx_commit(sock_el, msg, msg_id);
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_send_mbuf(lorawan_sock_t sock, uint8_t port, struct os_mbuf* om, lorawan_msg_id_t* msg_id)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    struct tx_msg* msg;
+    uint16_t size;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    size = os_mbuf_len(om);
+    if( size > LORAWAN_TX_PAYLOAD_MAX )
+        return LORAWAN_STATUS_ERROR;
+
+    msg = _lorawan_tx_alloc(sock_el);
+    if( msg == NULL )
+        return LORAWAN_STATUS_QUEUE_FULL;
+
+    /* Gather the chain into the slot */
+    msg->port = port;
+    msg->size = size;
+    if( os_mbuf_copydata(om, 0, size, msg->payload) != 0 ){
+        _lorawan_tx_abort(sock_el, msg);
+        return LORAWAN_STATUS_ERROR;
     }
 
-    if(status == LORAMAC_STATUS_OK)
-        return LORAWAN_STATUS_OK;
-    else
+    _lorawan_tx_commit(sock_el, msg, msg_id);
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_aggregation(lorawan_sock_t sock, uint8_t port, uint32_t max_delay_ms)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    struct lorawan_aggr* aggr = NULL;
+    os_time_t delay;
+    os_sr_t sr;
+    int i;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    /* At least one tick: a null delay marks a free entry */
+    delay = (os_time_t)( ( (uint64_t)max_delay_ms * OS_TICKS_PER_SEC ) / 1000 );
+    if( delay == 0 )
+        delay = 1;
+
+    OS_ENTER_CRITICAL(sr);
+    /* Entry of the port, or else a free one */
+    for(i = 0; i < LORAWAN_AGGR_PORT_MAX; i++){
+        if( ( sock_el->aggr[i].delay != 0 ) && ( sock_el->aggr[i].port == port ) ){
+            aggr = &(sock_el->aggr[i]);
+            break;
+        }
+        if( ( sock_el->aggr[i].delay == 0 ) && ( aggr == NULL ) )
+            aggr = &(sock_el->aggr[i]);
+    }
+
+    if( max_delay_ms != 0 ){
+        if( aggr == NULL ){
+            OS_EXIT_CRITICAL(sr);
+            return LORAWAN_STATUS_ERROR;
+        }
+        aggr->port = port;
+        aggr->delay = delay;
+        sock_el->aggr_ports[port/32] |= (1UL<<(port%32));
+    }
+    else{
+        if( ( aggr != NULL ) && ( aggr->port == port ) )
+            aggr->delay = 0;
+        sock_el->aggr_ports[port/32] &= ~(1UL<<(port%32));
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    /* The messages already queued may have to be sent now */
+    _lorawan_tx_kick();
+
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_priority(lorawan_sock_t sock, uint8_t prio)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    if( prio > LORAWAN_PRIO_LOWEST )
+        return LORAWAN_STATUS_ERROR;
+
+    sock_el->prio = prio;
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_weight(lorawan_sock_t sock, uint8_t weight)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    if( weight == 0 )
+        return LORAWAN_STATUS_ERROR;
+
+    sock_el->weight = weight;
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_quota(lorawan_sock_t sock, uint32_t quota_ms)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    os_sr_t sr;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    OS_ENTER_CRITICAL(sr);
+    _lorawan_quota_refill(sock_el);
+    sock_el->quota = quota_ms;
+    OS_EXIT_CRITICAL(sr);
+
+    /* Messages held by the previous quota may be sent now */
+    _lorawan_tx_kick();
+
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_queue_policy(lorawan_sock_t sock, uint8_t policy, uint32_t ttl_ms)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    os_sr_t sr;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    if( ( policy & ~( LORAWAN_QUEUE_REPLACE | LORAWAN_QUEUE_TTL ) )||( ( policy & LORAWAN_QUEUE_TTL )&&( ttl_ms == 0 ) ) )
         return LORAWAN_STATUS_ERROR;
+
+    OS_ENTER_CRITICAL(sr);
+    sock_el->queue_policy = policy;
+    sock_el->ttl = (os_time_t)( ( (uint64_t)ttl_ms * OS_TICKS_PER_SEC ) / 1000 );
+    OS_EXIT_CRITICAL(sr);
+
+    /* Apply it to the messages already queued */
+    _lorawan_tx_kick();
+
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_get_sock_stats(lorawan_sock_t sock, struct lorawan_sock_stats* stats)
+{
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    os_sr_t sr;
+
+    if( ( sock_el == NULL )||( stats == NULL ) )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    OS_ENTER_CRITICAL(sr);
+    _lorawan_quota_refill(sock_el);
+    stats->frames = sock_el->tx_frames;
+    stats->airtime_ms = sock_el->tx_airtime;
+    stats->weight = sock_el->weight;
+    stats->quota_ms = sock_el->quota;
+    stats->quota_used_ms = sock_el->quota_used;
+    stats->expired = sock_el->tx_expired;
+    stats->ttl_drops = sock_el->tx_ttl_drops;
+    stats->replaced = sock_el->tx_replaced;
+    OS_EXIT_CRITICAL(sr);
+
+    return LORAWAN_STATUS_OK;
+}
+
+/*
+ * Wait until the message is completed (or a packet is received if LORAWAN_EVENT_PENDING_RX is in ev).
+ * Each waiting task has its own semaphore: all of them are woken up by each event of the socket.
+ */
+static lorawan_event_t _lorawan_wait(struct sock_el* sock_el, uint32_t msg_id, lorawan_event_t ev, uint32_t timeout_ms){
+    struct lorawan_waiter waiter;
+    lorawan_event_t state;
+    os_time_t start;
+    os_time_t timo;
+    os_time_t elapsed;
+    os_sr_t sr;
+
+    if((timeout_ms == 0) || ((int32_t)timeout_ms == OS_WAIT_FOREVER)) {
+        timo = OS_WAIT_FOREVER;
+    } else {
+        timo = (timeout_ms*OS_TICKS_PER_SEC)/1000;
+    }
+    start = os_time_get();
+
+    /* Register before checking: an event occuring after the check releases the semaphore */
+    os_sem_init(&(waiter.sem), 0);
+    OS_ENTER_CRITICAL(sr);
+    SLIST_INSERT_HEAD(&(sock_el->waiters), &waiter, next);
+    OS_EXIT_CRITICAL(sr);
+
+    while(1){
+        state = _lorawan_tx_state(sock_el, msg_id);
+        if( ( ev & LORAWAN_EVENT_PENDING_RX ) && !STAILQ_EMPTY( &(sock_el->sock_eventq.evq_list) ) )
+            state |= LORAWAN_EVENT_PENDING_RX;
+
+        /* The message is completed (with or without the expected event), or a packet is received */
+        if( state != LORAWAN_EVENT_NONE )
+            break;
+
+        /* Each event of the socket releases the semaphore: check again on wake-up */
+        if( timo == OS_WAIT_FOREVER ){
+            os_sem_pend(&(waiter.sem), OS_WAIT_FOREVER);
+        }
+        else{
+            elapsed = os_time_get() - start;
+            if( elapsed >= timo )
+                break;
+            os_sem_pend(&(waiter.sem), timo - elapsed);
+        }
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    SLIST_REMOVE(&(sock_el->waiters), &waiter, lorawan_waiter, next);
+    OS_EXIT_CRITICAL(sr);
+
+    return state;
+}
+
+lorawan_event_t lorawan_wait_msg(lorawan_sock_t sock, lorawan_msg_id_t msg_id, lorawan_event_t ev, uint32_t timeout_ms){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( ( sock_el == NULL )||( msg_id == 0 ) )
+        return LORAWAN_EVENT_NONE;
+
+    /* Only the completion of the message is waited for */
+    return _lorawan_wait(sock_el, msg_id, ev & ~LORAWAN_EVENT_PENDING_RX, timeout_ms);
+}
+
+lorawan_event_t lorawan_wait_ev(lorawan_sock_t sock, lorawan_event_t ev, uint32_t timeout_ms){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_EVENT_NONE;
+
+    return _lorawan_wait(sock_el, sock_el->tx_last_id, ev, timeout_ms);
+}
+
+lorawan_event_t lorawan_get_state(lorawan_sock_t sock){
+    lorawan_event_t state;
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_EVENT_NONE;
+
+    state = sock_el->state;
+    if( !STAILQ_EMPTY( &(sock_el->sock_eventq.evq_list) ) )
+        state |= LORAWAN_EVENT_PENDING_RX;
+
+    return state;
+}
+
+uint32_t lorawan_estimate_airtime(lorawan_sock_t sock, uint8_t payload_size){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return 0;
+
+    return _lorawan_airtime_ms(_lorawan_tx_datarate(sock_el), payload_size);
+}
+
+lorawan_status_t lorawan_get_tx_budget(lorawan_sock_t sock, uint8_t payload_size, struct lorawan_tx_budget* budget){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( ( sock_el == NULL )||( budget == NULL ) )
+        return LORAWAN_STATUS_ERROR;
+
+    if( !_lorawan_dc_budget(_lorawan_airtime_ms(_lorawan_tx_datarate(sock_el), payload_size), budget) )
+        return LORAWAN_STATUS_ERROR;
+
+    return LORAWAN_STATUS_OK;
 }
 
 /*
@@ -159,6 +491,10 @@ lorawan_status_t lorawan_configure_ABP(uint32_t devAddr, uint8_t* nwkSkey, uint8
     mibReq.Param.AppSKey = appSkey;
     status |= LoRaMacMibSetRequestConfirm( &mibReq );
 
+    /* Per-frame MIC/encryption without key expansion */
+    aes_key_cache_set(&l_unicast_keys[LORAWAN_KEY_NWKS], nwkSkey);
+    aes_key_cache_set(&l_unicast_keys[LORAWAN_KEY_APPS], appSkey);
+
     mibReq.Type = MIB_NETWORK_JOINED;
     mibReq.Param.IsNetworkJoined = true;
     status |= LoRaMacMibSetRequestConfirm( &mibReq );
@@ -179,8 +515,10 @@ lorawan_status_t lorawan_configure_ABP(uint32_t devAddr, uint8_t* nwkSkey, uint8
     printf("classC:%d\r\n", state);
 #endif
 
-    if(status == LORAMAC_STATUS_OK)
+    if(status == LORAMAC_STATUS_OK){
+        _lorawan_tx_prepare();
         return LORAWAN_STATUS_OK;
+    }
     else
         return LORAWAN_STATUS_ERROR;
 }
@@ -223,39 +561,32 @@ lorawan_status_t lorawan_configure_OTAA(uint8_t* devEUI, uint8_t* appEUI, uint8_
 }
 
 lorawan_status_t lorawan_bind(lorawan_sock_t sock, uint32_t devAddr, uint8_t port){
-    uint8_t slot, position;
+    return lorawan_bind_range(sock, devAddr, port, port);
+}
 
+lorawan_status_t lorawan_bind_range(lorawan_sock_t sock, uint32_t devAddr, uint8_t first_port, uint8_t last_port){
     struct sock_el* sock_el = _lorawan_find_el(sock);
     if( sock_el == NULL )
         return LORAWAN_STATUS_INVALID_SOCK;
 
-    if( sock_el->devAddr == 0)
-        sock_el->devAddr = devAddr;
-
-    if( sock_el->devAddr != devAddr)
+    if( ( sock_el->devAddr != 0 ) && ( sock_el->devAddr != devAddr ) )
         return LORAWAN_STATUS_ERROR;
 
-    if( port == 0 )
-        return LORAWAN_STATUS_PORT_ALREADY_USED;
-
-    // Check if the devAddr/port is not binded by someone else !
-    if( lorawan_find_sock_by_params(devAddr, port) != 0 ){
+    if( first_port == 0 )
         return LORAWAN_STATUS_PORT_ALREADY_USED;
-    }
 
-    /* Find the correct port slot */
-    slot = port/32;
-    position = port%32;
-    sock_el->ports[slot] |= (1<<position);
+    if( first_port > last_port )
+        return LORAWAN_STATUS_ERROR;
 
-    return LORAWAN_STATUS_OK;
+    return _lorawan_demux_bind(sock_el, devAddr, first_port, last_port);
 }
 
-uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint8_t* payload, uint8_t payload_max_len, uint32_t timeout_ms){
-    uint8_t size = 0;
+/*
+ * Wait for a buffer on the socket queue
+ */
+static struct lorawan_rx_buf* _lorawan_recv_wait(lorawan_sock_t sock, uint32_t timeout_ms){
     struct os_event* ev;
     struct os_eventq *evq;
-    McpsIndication_t* rx_data;
     os_time_t timo;
     int i;
     //TODO: block several lorawan_recv on the same socket
@@ -264,7 +595,7 @@ uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint
 
     /* Check that a devAddr is present */
     if( ( sock_el == NULL )||( sock_el->devAddr == 0 ) )
-        return 0;
+        return NULL;
 
     /* Check that one port (at least) is present */
     for(i=0; i<sizeof(sock_el->ports)/sizeof(sock_el->ports[0]); i++){
@@ -274,7 +605,7 @@ uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint
             continue;
     }
     if( i == sizeof(sock_el->ports)/sizeof(sock_el->ports[0]) )
-        return 0;
+        return NULL;
 
     evq = &(sock_el->sock_eventq);
 
@@ -288,25 +619,177 @@ uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint
     ev = os_eventq_poll(&evq, 1, timo);
 
     if(ev == NULL) //means timeout
-        return 0;
+        return NULL;
 
     assert(ev->ev_arg != NULL);
-    rx_data = (McpsIndication_t*)(ev->ev_arg);
+    return (struct lorawan_rx_buf*)(ev->ev_arg);
+}
 
-    /* Feed all data */
-    *devAddr = rx_data->DevAddr;
-    *port = rx_data->Port;
-    memcpy(payload, rx_data->Buffer, MIN(payload_max_len, rx_data->BufferSize) );
-    memcpy(&(sock_el->mcps_ind), rx_data, sizeof(McpsIndication_t) );
+uint8_t lorawan_recv(lorawan_sock_t sock, uint32_t* devAddr, uint8_t* port, uint8_t* payload, uint8_t payload_max_len, uint32_t timeout_ms){
+    uint8_t size = 0;
+    struct lorawan_rx_buf* buf;
 
-    size = MIN(payload_max_len, rx_data->BufferSize);
+    buf = _lorawan_recv_wait(sock, timeout_ms);
+    if(buf == NULL)
+        return 0;
+
+    /* Feed all data */
+    *devAddr = buf->devAddr;
+    *port = buf->port;
+    size = MIN(payload_max_len, buf->size);
+    memcpy(payload, buf->payload, size);
 
-    /* Finally, free the event */
-    free(ev);
+    /* Finally, give back the buffer */
+    lorawan_buf_release(buf);
 
     return size;
 }
 
+struct lorawan_rx_buf* lorawan_recv_buf(lorawan_sock_t sock, uint32_t timeout_ms){
+    /* The reference of the socket queue is given to the caller */
+    return _lorawan_recv_wait(sock, timeout_ms);
+}
+
+void lorawan_buf_retain(struct lorawan_rx_buf* buf){
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    assert(buf->refcnt != 0);
+    buf->refcnt++;
+    OS_EXIT_CRITICAL(sr);
+}
+
+void lorawan_buf_release(struct lorawan_rx_buf* buf){
+    uint8_t refcnt;
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    assert(buf->refcnt != 0);
+    refcnt = --buf->refcnt;
+    OS_EXIT_CRITICAL(sr);
+
+    if( refcnt == 0 )
+        _lorawan_rx_buf_free(buf);
+}
+
+/*
+ * Register (or unregister if poll_sem is NULL) the polling task semaphore on the sockets
+ */
+static void _lorawan_poll_register(struct lorawan_pollfd* fds, uint8_t nfds, struct os_sem* poll_sem){
+    struct sock_el* sock_el;
+    os_sr_t sr;
+    int i;
+
+    for(i=0; i<nfds; i++){
+        sock_el = _lorawan_find_el(fds[i].sock);
+        if( sock_el == NULL )
+            continue;
+        OS_ENTER_CRITICAL(sr);
+        sock_el->poll_sem = poll_sem;
+        OS_EXIT_CRITICAL(sr);
+    }
+}
+
+int lorawan_poll(struct lorawan_pollfd* fds, uint8_t nfds, uint32_t timeout_ms){
+    struct sock_el* sock_el;
+    struct os_sem poll_sem;
+    os_time_t start;
+    os_time_t timo;
+    os_time_t elapsed;
+    os_sr_t sr;
+    int nb_ready;
+    int i;
+
+    /* Check all the sockets before blocking */
+    for(i=0; i<nfds; i++){
+        fds[i].revents = LORAWAN_EVENT_NONE;
+        if( ( fds[i].sock != 0 )&&( _lorawan_find_el(fds[i].sock) == NULL ) )
+            return -1;
+    }
+
+    if((timeout_ms == 0) || ((int32_t)timeout_ms == OS_WAIT_FOREVER)) {
+        timo = OS_WAIT_FOREVER;
+    } else {
+        timo = (timeout_ms*OS_TICKS_PER_SEC)/1000;
+    }
+    start = os_time_get();
+
+    /* Register before checking: an event occuring after the check releases the semaphore */
+    os_sem_init(&poll_sem, 0);
+    _lorawan_poll_register(fds, nfds, &poll_sem);
+
+    while(1){
+        nb_ready = 0;
+        for(i=0; i<nfds; i++){
+            sock_el = _lorawan_find_el(fds[i].sock);
+            if( sock_el == NULL )
+                continue;
+
+            OS_ENTER_CRITICAL(sr);
+            fds[i].revents = sock_el->poll_ev & fds[i].events;
+            sock_el->poll_ev &= ~fds[i].revents;
+            OS_EXIT_CRITICAL(sr);
+
+            if( ( fds[i].events & LORAWAN_EVENT_PENDING_RX )&&
+                !STAILQ_EMPTY( &(sock_el->sock_eventq.evq_list) ) )
+                fds[i].revents |= LORAWAN_EVENT_PENDING_RX;
+
+            if( fds[i].revents != LORAWAN_EVENT_NONE )
+                nb_ready++;
+        }
+
+        if( nb_ready != 0 )
+            break;
+
+        /* Each event of a registered socket releases the semaphore: check again on wake-up */
+        if( timo == OS_WAIT_FOREVER ){
+            os_sem_pend(&poll_sem, OS_WAIT_FOREVER);
+        }
+        else{
+            elapsed = os_time_get() - start;
+            if( elapsed >= timo )
+                break;
+            os_sem_pend(&poll_sem, timo - elapsed);
+        }
+    }
+
+    _lorawan_poll_register(fds, nfds, NULL);
+    return nb_ready;
+}
+
+lorawan_status_t lorawan_set_callbacks(lorawan_sock_t sock, lorawan_rx_cb_t on_rx, lorawan_tx_done_cb_t on_tx_done, void* arg){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    os_sr_t sr;
+
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    OS_ENTER_CRITICAL(sr);
+    sock_el->on_rx = on_rx;
+    sock_el->on_tx_done = on_tx_done;
+    sock_el->cb_arg = arg;
+    /* Only the messages completed from now are reported */
+    sock_el->tx_cb_idx = sock_el->tx_done_idx;
+    OS_EXIT_CRITICAL(sr);
+
+    return LORAWAN_STATUS_OK;
+}
+
+lorawan_status_t lorawan_set_callback_evq(lorawan_sock_t sock, struct os_eventq* evq){
+    struct sock_el* sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return LORAWAN_STATUS_INVALID_SOCK;
+
+    /* Completions already posted on the previous queue are reported on the new one */
+    if( sock_el->cb_evq != NULL )
+        os_eventq_remove(sock_el->cb_evq, &(sock_el->tx_cb_ev));
+    sock_el->cb_evq = evq;
+    if( ( evq != NULL )&&( sock_el->tx_cb_idx != sock_el->tx_done_idx ) )
+        os_eventq_put(evq, &(sock_el->tx_cb_ev));
+
+    return LORAWAN_STATUS_OK;
+}
+
 uint32_t lorawan_get_devAddr_unicast(void){
     MibRequestConfirm_t mibReq;
 
@@ -320,7 +803,10 @@ uint32_t lorawan_get_devAddr_unicast(void){
 lorawan_status_t lorawan_multicast_add(uint32_t devAddr, uint8_t* nwkSkey, uint8_t* appSkey, uint32_t downlink_counter){
     MulticastParams_t* mcast_param;
 
-    mcast_param = malloc( sizeof(MulticastParams_t) );
+    /* Remove the devAddr from the list, if it is present: its block goes back to the pool */
+    lorawan_multicast_remove(devAddr);
+
+    mcast_param = _lorawan_mcast_alloc();
 
     if(mcast_param == NULL)
         return LORAWAN_STATUS_ERROR;
@@ -331,11 +817,12 @@ lorawan_status_t lorawan_multicast_add(uint32_t devAddr, uint8_t* nwkSkey, uint8
     mcast_param->DownLinkCounter = downlink_counter;
     mcast_param->Next = NULL;
 
-    /* Remove the devAddr from the list, if it is present */
-    lorawan_multicast_remove(devAddr);
+    /* Removed by _lorawan_mcast_free */
+    aes_key_cache_set(mcast_param->NwkSKey, mcast_param->NwkSKey);
+    aes_key_cache_set(mcast_param->AppSKey, mcast_param->AppSKey);
 
     if( LoRaMacMulticastChannelLink(mcast_param) != LORAMAC_STATUS_OK ){
-        free(mcast_param);
+        _lorawan_mcast_free(mcast_param);
         return LORAWAN_STATUS_ERROR;
     }
 
@@ -368,36 +855,25 @@ lorawan_status_t lorawan_multicast_remove(uint32_t devAddr){
     if( LoRaMacMulticastChannelUnlink(mcast_el_cur) != LORAMAC_STATUS_OK )
         return LORAWAN_STATUS_ERROR;
 
-    /* Finally free the element */
-    free(mcast_el_cur);
+    /* Finally give back the element to the pool */
+    _lorawan_mcast_free(mcast_el_cur);
 
     return LORAWAN_STATUS_OK;
 }
 
+void lorawan_get_stats(struct lorawan_stats* stats){
+    _lorawan_stats_get(stats);
+}
+
 /*
  * Find the socket matching with the couple devAddr/port
  */
 lorawan_sock_t lorawan_find_sock_by_params(uint32_t devAddr, uint8_t port)
 {
-    struct sock_el* i_list;
-    uint8_t slot, position;
-    slot = port/32;
-    position = port%32;
-
-    if( SLIST_EMPTY(&l_sock_list) )
-        return 0;
-
-    /* Search devAddr/Port on all sockets */
-    for (i_list = SLIST_FIRST(&l_sock_list); i_list != NULL; i_list = SLIST_NEXT(i_list, sc_next)) {
-        if( i_list->devAddr == devAddr){
-            if( ( i_list->ports[slot] & (1<<position) ) != 0 ) // "devAddr+Port" match !
-                break;
-        }
-    }
+    struct sock_el* sock_el = _lorawan_demux_find(devAddr, port);
 
-    // i_list is NULL if no match
-    if( i_list == NULL )
+    if( sock_el == NULL )
         return 0;
     else
-        return i_list->sock;
+        return sock_el->sock;
 }
@@ -0,0 +1,360 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "lorawan_api/lorawan_api.h"
+#include "lorawan_api/lorawan_api_private.h"
+
+#include "board-utils.h"
+#include "queue-board.h"
+
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+#include "config/config.h"
+#endif
+
+#if MYNEWT_VAL(LORAWAN_DC_LEDGER) && MYNEWT_VAL(LORAWAN_REGION_EU868)
+
+/*
+ * Duty cycle ledger: one bucket per band, whose capacity is the airtime allowed over one hour.
+ * It also follows the rule of the MAC: after a frame, the band is off for airtime * (dcycle - 1).
+ */
+
+/* EU868 bands of the MAC (RegionEU868.h): 1 / duty cycle */
+#define LORAWAN_DC_NB_BANDS     5
+static const uint16_t lorawan_dc_cycles[LORAWAN_DC_NB_BANDS] = { 100, 100, 1000, 10, 100 };
+
+/* EU868_MAX_NB_CHANNELS */
+#define LORAWAN_DC_NB_CHANNELS  16
+
+#define LORAWAN_DC_HOUR_MS      3600000UL
+
+struct dc_band {
+    uint32_t used_ms;           /* airtime in the bucket */
+    uint64_t last_ms;           /* last refill of the bucket */
+    uint64_t ready_ms;          /* end of the off time of the band */
+};
+static struct dc_band lorawan_dc_bands[LORAWAN_DC_NB_BANDS];
+
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+/*
+ * Saved state of a band: relative to the save time (the timebase restarts at boot)
+ */
+struct dc_saved {
+    uint32_t used_ms;
+    uint32_t off_ms;
+};
+
+static struct os_callout lorawan_dc_save;
+#endif
+
+static uint64_t _lorawan_dc_now(void){
+    return timer_get_us64() / 1000;
+}
+
+static bool _lorawan_dc_active(void){
+    return ( _lorawan_region() == LORAMAC_REGION_EU868 );
+}
+
+/*
+ * Give back the airtime elapsed since the last refill (by whole units of airtime: no drift).
+ * The ledger is updated by the LoRaWAN task and read by the API tasks: every access to
+ * lorawan_dc_bands[] is done in a critical section, with the time taken in the same one.
+ */
+static void _lorawan_dc_refill(uint8_t band, uint64_t now){
+    struct dc_band* b = &lorawan_dc_bands[band];
+    uint64_t refill = ( now - b->last_ms ) / lorawan_dc_cycles[band];
+
+    if( refill >= b->used_ms ){
+        b->used_ms = 0;
+        b->last_ms = now;
+    }
+    else{
+        b->used_ms -= refill;
+        b->last_ms += refill * lorawan_dc_cycles[band];
+    }
+}
+
+/*
+ * Delay before a frame can leave on a band
+ */
+static uint32_t _lorawan_dc_band_wait(uint8_t band, uint32_t airtime_ms, uint64_t now){
+    struct dc_band* b = &lorawan_dc_bands[band];
+    uint32_t cap = LORAWAN_DC_HOUR_MS / lorawan_dc_cycles[band];
+    uint64_t wait = 0;
+
+    _lorawan_dc_refill(band, now);
+
+    if( b->used_ms + airtime_ms > cap )
+        wait = (uint64_t)( b->used_ms + airtime_ms - cap ) * lorawan_dc_cycles[band];
+    if( b->ready_ms > now + wait )
+        wait = b->ready_ms - now;
+
+    return ( wait > UINT32_MAX ) ? UINT32_MAX : (uint32_t)wait;
+}
+
+/*
+ * Bands of the enabled channels
+ */
+static uint32_t _lorawan_dc_bands_enabled(void){
+    MibRequestConfirm_t mibReq;
+    ChannelParams_t* channels;
+    uint16_t* mask;
+    uint32_t bands = 0;
+    uint8_t i;
+
+    mibReq.Type = MIB_CHANNELS;
+    if( LoRaMacMibGetRequestConfirm( &mibReq ) != LORAMAC_STATUS_OK )
+        return 0;
+    channels = mibReq.Param.ChannelList;
+
+    mibReq.Type = MIB_CHANNELS_MASK;
+    if( LoRaMacMibGetRequestConfirm( &mibReq ) != LORAMAC_STATUS_OK )
+        return 0;
+    mask = mibReq.Param.ChannelsMask;
+
+    for(i=0; i<LORAWAN_DC_NB_CHANNELS; i++){
+        if( ( mask[0] & ( 1 << i ) )&&( channels[i].Frequency != 0 )&&( channels[i].Band < LORAWAN_DC_NB_BANDS ) )
+            bands |= ( 1 << channels[i].Band );
+    }
+    return bands;
+}
+
+/*
+ * First band available for a frame, among the enabled ones (in a critical section)
+ * return: the band / LORAWAN_DC_NB_BANDS if no channel is enabled
+ */
+static uint8_t _lorawan_dc_best_band(uint32_t bands, uint32_t airtime_ms, uint32_t* wait_ms){
+    uint64_t now = _lorawan_dc_now();
+    uint8_t best = LORAWAN_DC_NB_BANDS;
+    uint32_t wait;
+    uint8_t i;
+
+    *wait_ms = UINT32_MAX;
+    for(i=0; i<LORAWAN_DC_NB_BANDS; i++){
+        if( !( bands & ( 1 << i ) ) )
+            continue;
+        wait = _lorawan_dc_band_wait(i, airtime_ms, now);
+        if( wait < *wait_ms ){
+            *wait_ms = wait;
+            best = i;
+        }
+    }
+    return best;
+}
+
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+static int _lorawan_dc_conf_set(int argc, char** argv, char* val){
+    struct dc_saved saved[LORAWAN_DC_NB_BANDS];
+    uint64_t now;
+    int len = sizeof(saved);
+    os_sr_t sr;
+    int rc;
+    int i;
+
+    if( ( argc != 1 )||( strcmp(argv[0], "dc") != 0 ) )
+        return OS_ENOENT;
+
+    rc = conf_bytes_from_str(val, saved, &len);
+    if( ( rc != 0 )||( len != sizeof(saved) ) )
+        return OS_EINVAL;
+
+    /* The time spent in reset is unknown: count it as 0 (conservative) */
+    OS_ENTER_CRITICAL(sr);
+    now = _lorawan_dc_now();
+    for(i=0; i<LORAWAN_DC_NB_BANDS; i++){
+        lorawan_dc_bands[i].used_ms = saved[i].used_ms;
+        lorawan_dc_bands[i].last_ms = now;
+        lorawan_dc_bands[i].ready_ms = now + saved[i].off_ms;
+    }
+    OS_EXIT_CRITICAL(sr);
+    return 0;
+}
+
+static void _lorawan_dc_conf_str(char* buf, int buf_len){
+    struct dc_saved saved[LORAWAN_DC_NB_BANDS];
+    uint64_t now;
+    os_sr_t sr;
+    int i;
+
+    OS_ENTER_CRITICAL(sr);
+    now = _lorawan_dc_now();
+    for(i=0; i<LORAWAN_DC_NB_BANDS; i++){
+        _lorawan_dc_refill(i, now);
+        saved[i].used_ms = lorawan_dc_bands[i].used_ms;
+        saved[i].off_ms = ( lorawan_dc_bands[i].ready_ms > now ) ? (uint32_t)( lorawan_dc_bands[i].ready_ms - now ) : 0;
+    }
+    OS_EXIT_CRITICAL(sr);
+    conf_str_from_bytes(saved, sizeof(saved), buf, buf_len);
+}
+
+static char* _lorawan_dc_conf_get(int argc, char** argv, char* val, int val_len_max){
+    if( ( argc != 1 )||( strcmp(argv[0], "dc") != 0 ) )
+        return NULL;
+
+    _lorawan_dc_conf_str(val, val_len_max);
+    return val;
+}
+
+static int _lorawan_dc_conf_export(void (*func)(char* name, char* val), enum conf_export_tgt tgt){
+    char buf[CONF_STR_FROM_BYTES_LEN(sizeof(struct dc_saved) * LORAWAN_DC_NB_BANDS)];
+
+    _lorawan_dc_conf_str(buf, sizeof(buf));
+    func("lorawan/dc", buf);
+    return 0;
+}
+
+static struct conf_handler lorawan_dc_conf = {
+    .ch_name = "lorawan",
+    .ch_get = _lorawan_dc_conf_get,
+    .ch_set = _lorawan_dc_conf_set,
+    .ch_commit = NULL,
+    .ch_export = _lorawan_dc_conf_export,
+};
+
+static void _lorawan_dc_save_cb(struct os_event* ev){
+    char buf[CONF_STR_FROM_BYTES_LEN(sizeof(struct dc_saved) * LORAWAN_DC_NB_BANDS)];
+
+    _lorawan_dc_conf_str(buf, sizeof(buf));
+    conf_save_one("lorawan/dc", buf);
+}
+#endif
+
+void _lorawan_dc_init(void){
+    uint64_t now = _lorawan_dc_now();
+    int rc;
+    int i;
+
+    for(i=0; i<LORAWAN_DC_NB_BANDS; i++)
+        lorawan_dc_bands[i].last_ms = now;
+
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+    /* Restored by conf_load() of the application, after sysinit().
+     * Saved from the default event queue: the flash write does not fit the LoRaWAN task stack */
+    os_callout_init(&lorawan_dc_save, os_eventq_dflt_get(), _lorawan_dc_save_cb, NULL);
+    rc = conf_register(&lorawan_dc_conf);
+    assert(rc == 0);
+#else
+    (void)rc;
+#endif
+}
+
+void _lorawan_dc_consume(uint8_t channel, uint32_t airtime_ms, uint8_t nb_tx){
+    MibRequestConfirm_t mibReq;
+    struct dc_band* b;
+    uint64_t now;
+    uint8_t band;
+    os_sr_t sr;
+
+    if( !_lorawan_dc_active() || ( airtime_ms == 0 ) || ( channel >= LORAWAN_DC_NB_CHANNELS ) )
+        return;
+
+    mibReq.Type = MIB_CHANNELS;
+    if( LoRaMacMibGetRequestConfirm( &mibReq ) != LORAMAC_STATUS_OK )
+        return;
+    band = mibReq.Param.ChannelList[channel].Band;
+    if( band >= LORAWAN_DC_NB_BANDS )
+        return;
+
+    if( nb_tx == 0 )
+        nb_tx = 1;
+
+    b = &lorawan_dc_bands[band];
+    OS_ENTER_CRITICAL(sr);
+    now = _lorawan_dc_now();
+    _lorawan_dc_refill(band, now);
+    b->used_ms += airtime_ms * nb_tx;
+    b->ready_ms = now + (uint64_t)airtime_ms * ( lorawan_dc_cycles[band] - 1 );
+    OS_EXIT_CRITICAL(sr);
+
+#if MYNEWT_VAL(LORAWAN_DC_PERSIST)
+    /* Saved at most once per period */
+    if( !os_callout_queued(&lorawan_dc_save) )
+        os_callout_reset(&lorawan_dc_save, LORAWAN_DC_SAVE_PERIOD_S * OS_TICKS_PER_SEC);
+#endif
+}
+
+uint32_t _lorawan_dc_wait_ms(uint32_t airtime_ms){
+    uint32_t bands;
+    uint32_t wait;
+    uint8_t band;
+    os_sr_t sr;
+
+    if( !_lorawan_dc_active() )
+        return 0;
+
+    bands = _lorawan_dc_bands_enabled();
+    OS_ENTER_CRITICAL(sr);
+    band = _lorawan_dc_best_band(bands, airtime_ms, &wait);
+    OS_EXIT_CRITICAL(sr);
+
+    /* No enabled channel: let the MAC report it */
+    if( band == LORAWAN_DC_NB_BANDS )
+        return 0;
+
+    return wait;
+}
+
+bool _lorawan_dc_budget(uint32_t airtime_ms, struct lorawan_tx_budget* budget){
+    uint32_t bands;
+    uint8_t band;
+    uint32_t wait;
+    uint32_t cap;
+    os_sr_t sr;
+
+    if( !_lorawan_dc_active() )
+        return false;
+
+    /* The used airtime is the one the wait was computed from */
+    bands = _lorawan_dc_bands_enabled();
+    OS_ENTER_CRITICAL(sr);
+    band = _lorawan_dc_best_band(bands, airtime_ms, &wait);
+    if( band != LORAWAN_DC_NB_BANDS )
+        budget->used_ms = lorawan_dc_bands[band].used_ms;
+    OS_EXIT_CRITICAL(sr);
+    if( band == LORAWAN_DC_NB_BANDS )
+        return false;
+
+    cap = LORAWAN_DC_HOUR_MS / lorawan_dc_cycles[band];
+    budget->band = band;
+    budget->remaining_ms = ( budget->used_ms < cap ) ? ( cap - budget->used_ms ) : 0;
+    budget->airtime_ms = airtime_ms;
+    budget->wait_ms = wait;
+    return true;
+}
+
+#else
+
+/* No duty cycle ledger (or no EU868 region) */
+void _lorawan_dc_init(void){
+}
+
+void _lorawan_dc_consume(uint8_t channel, uint32_t airtime_ms, uint8_t nb_tx){
+}
+
+uint32_t _lorawan_dc_wait_ms(uint32_t airtime_ms){
+    return 0;
+}
+
+bool _lorawan_dc_budget(uint32_t airtime_ms, struct lorawan_tx_budget* budget){
+    return false;
+}
+
+#endif
@@ -28,40 +28,1165 @@
 #include "LoRaMac.h"
 #include "hal/hal_bsp.h"
 
+#include "board-utils.h"
 #include "queue-board.h"
 
 static struct os_task lorawan_eventq_task;
 static os_stack_t lorawan_eventq_stack[OS_STACK_ALIGN(LORAWAN_STACK_SIZE)];
 static void lorawan_eventq_thread (void* data);
 
+static void _lorawan_tx_drain(struct os_event* ev);
+static void _lorawan_tx_keystream(struct os_event* ev);
+static void _lorawan_tx_drop(struct sock_el* sock_el, struct tx_msg* msg, lorawan_event_t ev);
+static void _lorawan_sock_signal(struct sock_el* sock_el);
 
 /*
- * Socket list head pointer
+ * Uplink scheduler: drained from the LoRaWAN task each time the MAC becomes idle
  */
-SLIST_HEAD(s_socket, sock_el) l_sock_list =
-    SLIST_HEAD_INITIALIZER();
+static struct os_event lorawan_tx_ev = {
+    .ev_cb = _lorawan_tx_drain,
+};
+static struct os_event lorawan_tx_ks_ev = {
+    .ev_cb = _lorawan_tx_keystream,
+};
+static struct os_callout lorawan_tx_retry;
+static struct os_callout lorawan_tx_flush;
+static struct os_callout lorawan_tx_deadline;
+static uint32_t lorawan_tx_seq = 0;
+
+/*
+ * Socket whose messages are being sent by the drain (read out of any critical section):
+ * they are not replaced at enqueue time meanwhile
+ */
+static struct sock_el* lorawan_tx_picked = NULL;
+
+/*
+ * Frame built from the aggregated messages of a port
+ */
+static uint8_t lorawan_tx_frame[LORAWAN_AGGR_FRAME_MAX];
+
+/*
+ * Messages handed to the MAC (several if aggregated), waiting for their McpsConfirm
+ */
+static struct {
+    bool busy;
+    lorawan_sock_t sock;
+    uint32_t ids[LORAWAN_TX_QUEUE_LEN];
+    uint8_t nb_ids;
+} lorawan_tx_inflight;
+
+/*
+ * Socket table
+ */
+struct sock_el l_sock_table[LORAWAN_SOCKET_MAX];
+
+uint8_t l_unicast_keys[2];
 
 struct sock_el* _lorawan_find_el(lorawan_sock_t sock){
+    struct sock_el* sock_el;
+
+    if( LORAWAN_SOCK_IDX(sock) >= LORAWAN_SOCKET_MAX )
+        return NULL;
+
+    /* A free entry has a null identifier, a reused entry has a new generation */
+    sock_el = &l_sock_table[LORAWAN_SOCK_IDX(sock)];
+    if( ( sock == 0 ) || ( sock_el->sock != sock ) )
+        return NULL;
+
+    return sock_el;
+}
+
+/*
+ * Downlink buffers pool: the payload is stored right after the buffer header
+ */
+#define LORAWAN_RX_BUF_SIZE     ( sizeof(struct lorawan_rx_buf) + LORAWAN_RX_PAYLOAD_MAX )
+static struct os_mempool lorawan_rx_pool;
+static os_membuf_t lorawan_rx_pool_mem[OS_MEMPOOL_SIZE(LORAWAN_RX_BUF_COUNT, LORAWAN_RX_BUF_SIZE)];
+
+void _lorawan_rx_buf_free(struct lorawan_rx_buf* buf){
+    os_error_t rc;
+
+    rc = os_memblock_put(&lorawan_rx_pool, buf);
+    assert(rc == OS_OK);
+}
+
+static uint32_t lorawan_rx_drop_no_buf = 0;
+
+/*
+ * Multicast parameters pool: the blocks are linked in the MAC multicast list
+ */
+static struct os_mempool lorawan_mcast_pool;
+static os_membuf_t lorawan_mcast_pool_mem[OS_MEMPOOL_SIZE(LORAWAN_MULTICAST_MAX, sizeof(MulticastParams_t))];
+
+MulticastParams_t* _lorawan_mcast_alloc(void){
+    return os_memblock_get(&lorawan_mcast_pool);
+}
+
+void _lorawan_mcast_free(MulticastParams_t* mcast_param){
+    os_error_t rc;
+
+    aes_key_cache_set(mcast_param->NwkSKey, NULL);
+    aes_key_cache_set(mcast_param->AppSKey, NULL);
+
+    rc = os_memblock_put(&lorawan_mcast_pool, mcast_param);
+    assert(rc == OS_OK);
+}
+
+#if MYNEWT_VAL(LORAWAN_HEAP_TRACE)
+/*
+ * Heap allocations counter: the allocators are wrapped at link time (see pkg.yml)
+ */
+static uint32_t lorawan_heap_allocs = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+static void _lorawan_heap_count(void){
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    lorawan_heap_allocs++;
+    OS_EXIT_CRITICAL(sr);
+}
+
+void* __wrap_malloc(size_t size){
+    _lorawan_heap_count();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size){
+    _lorawan_heap_count();
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size){
+    _lorawan_heap_count();
+    return __real_realloc(ptr, size);
+}
+#endif
+
+static void _lorawan_pool_stats(struct os_mempool* pool, struct lorawan_pool_stats* stats){
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    stats->blocks = pool->mp_num_blocks;
+    stats->free = pool->mp_num_free;
+    stats->min_free = pool->mp_min_free;
+    OS_EXIT_CRITICAL(sr);
+}
+
+void _lorawan_stats_get(struct lorawan_stats* stats){
+    uint16_t used;
+
+    _lorawan_pool_stats(&lorawan_rx_pool, &(stats->rx_buf));
+    _lorawan_pool_stats(&lorawan_mcast_pool, &(stats->multicast));
+    timer_slots_get(&(stats->timer.blocks), &used);
+    stats->timer.free = stats->timer.blocks - used;
+    stats->timer.min_free = stats->timer.free; // a timer is never released
+    stats->rx_drop_no_buf = lorawan_rx_drop_no_buf;
+    stats->irq_overflows = gpio_irq_overflows_get();
+    stats->radio_busy_timeouts = radio_busy_timeouts_get();
+#if MYNEWT_VAL(LORAWAN_HEAP_TRACE)
+    stats->heap_allocs = lorawan_heap_allocs;
+#else
+    stats->heap_allocs = 0;
+#endif
+}
+
+/*
+ * Downlink demultiplexing table
+ */
+static struct demux_el l_demux_table[LORAWAN_DEMUX_SIZE];
+
+/*
+ * Find the demultiplexing entry of a devAddr
+ * (the table only holds the unicast devAddr and a few multicast ones)
+ */
+static struct demux_el* _lorawan_demux_get(uint32_t devAddr){
+    int i;
+
+    for(i=0; i<LORAWAN_DEMUX_SIZE; i++){
+        if( ( l_demux_table[i].nb_ports != 0 ) && ( l_demux_table[i].devAddr == devAddr ) )
+            return &l_demux_table[i];
+    }
+    return NULL;
+}
+
+lorawan_status_t _lorawan_demux_bind(struct sock_el* sock_el, uint32_t devAddr, uint8_t first_port, uint8_t last_port){
+    struct demux_el* demux_el;
+    lorawan_status_t status = LORAWAN_STATUS_OK;
+    uint8_t sock_ref = LORAWAN_SOCK_IDX(sock_el->sock) + 1;
+    os_sr_t sr;
+    int i, port;
+
+    OS_ENTER_CRITICAL(sr);
+
+    demux_el = _lorawan_demux_get(devAddr);
+    if( demux_el == NULL ){
+        /* First bind on this devAddr: take a free entry */
+        for(i=0; i<LORAWAN_DEMUX_SIZE; i++){
+            if( l_demux_table[i].nb_ports == 0 ){
+                demux_el = &l_demux_table[i];
+                memset(demux_el->port_sock, 0, sizeof(demux_el->port_sock));
+                demux_el->devAddr = devAddr;
+                break;
+            }
+        }
+        if( demux_el == NULL ){
+            status = LORAWAN_STATUS_ERROR;
+            goto out;
+        }
+    }
+
+    /* Check that the devAddr/ports are not bound by someone else ! */
+    for(port=first_port; port<=last_port; port++){
+        if( demux_el->port_sock[port] != 0 ){
+            status = LORAWAN_STATUS_PORT_ALREADY_USED;
+            goto out;
+        }
+    }
+
+    for(port=first_port; port<=last_port; port++){
+        demux_el->port_sock[port] = sock_ref;
+        sock_el->ports[port/32] |= (1UL<<(port%32));
+    }
+    demux_el->nb_ports += last_port - first_port + 1;
+    sock_el->devAddr = devAddr;
+
+out:
+    OS_EXIT_CRITICAL(sr);
+    return status;
+}
+
+void _lorawan_demux_unbind(struct sock_el* sock_el){
+    struct demux_el* demux_el;
+    os_sr_t sr;
+    int port;
+
+    OS_ENTER_CRITICAL(sr);
+    demux_el = _lorawan_demux_get(sock_el->devAddr);
+    if( demux_el != NULL ){
+        for(port=0; port<256; port++){
+            if( ( sock_el->ports[port/32] & (1UL<<(port%32)) ) != 0 ){
+                demux_el->port_sock[port] = 0;
+                demux_el->nb_ports--;
+            }
+        }
+    }
+    memset(sock_el->ports, 0, sizeof(sock_el->ports));
+    OS_EXIT_CRITICAL(sr);
+}
+
+struct sock_el* _lorawan_demux_find(uint32_t devAddr, uint8_t port){
+    struct demux_el* demux_el;
+    uint8_t sock_ref;
+
+    demux_el = _lorawan_demux_get(devAddr);
+    if( demux_el == NULL )
+        return NULL;
+
+    sock_ref = demux_el->port_sock[port];
+    if( sock_ref == 0 )
+        return NULL;
+
+    return &l_sock_table[sock_ref - 1];
+}
+
+void _lorawan_tx_init(struct sock_el* sock_el){
+    int i;
+
+    STAILQ_INIT(&(sock_el->tx_free));
+    STAILQ_INIT(&(sock_el->tx_pending));
+    sock_el->tx_next_id = 1;
+
+    for(i=0; i<LORAWAN_TX_QUEUE_LEN; i++){
+        STAILQ_INSERT_TAIL(&(sock_el->tx_free), &(sock_el->tx_msgs[i]), tm_next);
+    }
+}
+
+struct tx_msg* _lorawan_tx_alloc(struct sock_el* sock_el){
+    struct tx_msg* msg;
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    msg = STAILQ_FIRST(&(sock_el->tx_free));
+    if( msg != NULL )
+        STAILQ_REMOVE_HEAD(&(sock_el->tx_free), tm_next);
+    OS_EXIT_CRITICAL(sr);
+
+    if( msg != NULL )
+        msg->has_deadline = false;
+
+    return msg;
+}
+
+void _lorawan_tx_abort(struct sock_el* sock_el, struct tx_msg* msg){
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_INSERT_HEAD(&(sock_el->tx_free), msg, tm_next);
+    OS_EXIT_CRITICAL(sr);
+}
+
+/*
+ * Fair share position of a socket whose queue was empty (in a critical section): at least the one
+ * of the least served backlogged socket, so that the airtime not used while idle is not credited
+ */
+static void _lorawan_share_resume(struct sock_el* sock_el){
+    struct sock_el* i_list;
+    uint32_t min_vtime = 0;
+    bool found = false;
+    int i;
+
+    for (i = 0; i < LORAWAN_SOCKET_MAX; i++) {
+        i_list = &l_sock_table[i];
+        if( ( i_list->sock == 0 )||( i_list == sock_el )||STAILQ_EMPTY(&(i_list->tx_pending)) )
+            continue;
+        if( !found || ( (int32_t)(i_list->vtime - min_vtime) < 0 ) ){
+            min_vtime = i_list->vtime;
+            found = true;
+        }
+    }
+
+    if( found && ( (int32_t)(min_vtime - sock_el->vtime) > 0 ) )
+        sock_el->vtime = min_vtime;
+}
+
+void _lorawan_tx_commit(struct sock_el* sock_el, struct tx_msg* msg, uint32_t* msg_id){
+    struct tx_msg* replaced = NULL;
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    if( STAILQ_EMPTY(&(sock_el->tx_pending)) )
+        _lorawan_share_resume(sock_el);
+
+    /* Replace policy: the message takes the place of the queued one of its port, so that
+     * a burst does not fill the queue while the MAC is busy (see also _lorawan_tx_replace) */
+    if( ( sock_el->queue_policy & LORAWAN_QUEUE_REPLACE )&&( sock_el != lorawan_tx_picked ) ){
+        STAILQ_FOREACH(replaced, &(sock_el->tx_pending), tm_next){
+            if( replaced->port == msg->port )
+                break;
+        }
+    }
+
+    msg->time = os_time_get();
+    if( msg->has_deadline )
+        msg->deadline += msg->time;
+    msg->id = sock_el->tx_next_id++;
+    if( sock_el->tx_next_id == 0 )
+        sock_el->tx_next_id = 1; // 0 is never a valid message id
+    sock_el->tx_last_id = msg->id;
+
+    if( replaced != NULL ){
+        /* The position and the aging, not the TTL (counted from the enqueue of each message) */
+        msg->seq = replaced->seq;
+        msg->aging_time = replaced->aging_time;
+        STAILQ_INSERT_AFTER(&(sock_el->tx_pending), replaced, msg, tm_next);
+        _lorawan_tx_drop(sock_el, replaced, LORAWAN_EVENT_DROPPED);
+        sock_el->tx_replaced++;
+    }
+    else{
+        msg->seq = lorawan_tx_seq++;
+        msg->aging_time = msg->time;
+        STAILQ_INSERT_TAIL(&(sock_el->tx_pending), msg, tm_next);
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if( msg_id != NULL )
+        *msg_id = msg->id;
+
+    if( replaced != NULL ){
+        /* The callback never runs on the sending task */
+        _lorawan_sock_signal(sock_el);
+        if( sock_el->on_tx_done != NULL )
+            os_eventq_put(( sock_el->cb_evq != NULL ) ? sock_el->cb_evq : os_eventq_lorawan_get(),
+                          &(sock_el->tx_cb_ev));
+    }
+
+    _lorawan_tx_kick();
+}
+
+void _lorawan_tx_kick(void){
+    /* No effect if the scheduler is already pending */
+    os_eventq_put(os_eventq_lorawan_get(), &lorawan_tx_ev);
+}
+
+lorawan_status_t _lorawan_tx_enqueue(struct sock_el* sock_el, uint8_t port, uint8_t* payload, uint8_t payload_size,
+                                     uint32_t deadline_ms, uint32_t* msg_id){
+    struct tx_msg* msg;
+
+    if( payload_size > LORAWAN_TX_PAYLOAD_MAX )
+        return LORAWAN_STATUS_ERROR;
+
+    /* Take a free slot */
+    msg = _lorawan_tx_alloc(sock_el);
+    if( msg == NULL )
+        return LORAWAN_STATUS_QUEUE_FULL;
+
+    /* The slot is owned by the caller until it is queued: copy out of the critical section */
+    msg->port = port;
+    msg->size = payload_size;
+    memcpy(msg->payload, payload, payload_size);
+
+    /* Relative to the enqueue time (set by _lorawan_tx_commit) */
+    msg->has_deadline = ( deadline_ms != 0 );
+    msg->deadline = (os_time_t)( ( (uint64_t)deadline_ms * OS_TICKS_PER_SEC + 999 ) / 1000 );
+
+    _lorawan_tx_commit(sock_el, msg, msg_id);
+    return LORAWAN_STATUS_OK;
+}
+
+/*
+ * Get the max application payload at the current datarate
+ */
+static uint8_t _lorawan_tx_max_payload(void){
+    LoRaMacTxInfo_t tx_info;
+
+    /* Fallback if the MAC can't tell (e.g. not joined yet) */
+    tx_info.MaxPossiblePayload = LORAWAN_TX_PAYLOAD_MAX;
+
+    /* The size is not relevant here: only the max payload is used */
+    LoRaMacQueryTxPossible(0, &tx_info);
+
+    return MIN(tx_info.MaxPossiblePayload, LORAWAN_AGGR_FRAME_MAX);
+}
+
+/*
+ * Keystream of the next uplink, so that its payload encryption is a XOR.
+ * Computed on the LoRaWAN task once the MAC is idle (after the McpsConfirm or the ABP
+ * configuration), and only if no queued message was sent in the meantime: the drain runs
+ * first, and a frame in flight makes the keystream useless.
+ */
+static void _lorawan_tx_keystream(struct os_event* ev){
+    MibRequestConfirm_t mibReq;
+    uint32_t devAddr;
+
+    /* The counter of the MAC is the one of the frame in flight */
+    if( lorawan_tx_inflight.busy )
+        return;
+
+    mibReq.Type = MIB_DEV_ADDR;
+    if( LoRaMacMibGetRequestConfirm( &mibReq ) != LORAMAC_STATUS_OK )
+        return;
+    devAddr = mibReq.Param.DevAddr;
+
+    mibReq.Type = MIB_UPLINK_COUNTER;
+    if( LoRaMacMibGetRequestConfirm( &mibReq ) != LORAMAC_STATUS_OK )
+        return;
+
+    /* Only the ABP AppSKey is known (cached): nothing is prepared in OTAA */
+    aes_keystream_prepare(&l_unicast_keys[LORAWAN_KEY_APPS], devAddr, mibReq.Param.UpLinkCounter,
+                          _lorawan_tx_max_payload());
+}
+
+void _lorawan_tx_prepare(void){
+    os_eventq_put(os_eventq_lorawan_get(), &lorawan_tx_ks_ev);
+}
+
+/*
+ * Max delay (in ticks) of the messages of an aggregated port
+ */
+static os_time_t _lorawan_aggr_delay(struct sock_el* sock_el, uint8_t port){
+    int i;
+
+    for(i = 0; i < LORAWAN_AGGR_PORT_MAX; i++){
+        if( ( sock_el->aggr[i].delay != 0 ) && ( sock_el->aggr[i].port == port ) )
+            return sock_el->aggr[i].delay;
+    }
+    return 0;
+}
+
+/*
+ * Check if the head message of an aggregated port must be sent now:
+ * the frame is full, no more message can be added, or the delay of the oldest message is elapsed.
+ * Otherwise, wait gives the remaining delay (in ticks).
+ */
+static bool _lorawan_tx_aggr_ready(struct sock_el* sock_el, struct tx_msg* head, uint8_t max_payload, os_time_t* wait){
+    struct tx_msg* msg;
+    uint16_t size = 0;
+    os_time_t delay;
+    os_time_t age;
+
+    for(msg = head; msg != NULL; msg = STAILQ_NEXT(msg, tm_next)){
+        /* A message on another port stops the aggregation */
+        if( msg->port != head->port )
+            return true;
+        /* A message with a deadline is not held for aggregation */
+        if( msg->has_deadline )
+            return true;
+        size += 1 + msg->size;
+        if( size >= max_payload )
+            return true;
+    }
+
+    /* All the slots are used: no more message can come */
+    if( STAILQ_EMPTY(&(sock_el->tx_free)) )
+        return true;
+
+    /* The head is the oldest message of the frame: its port delay gives the flush time */
+    delay = _lorawan_aggr_delay(sock_el, head->port);
+    age = os_time_get() - head->time;
+    if( age >= delay )
+        return true;
+
+    *wait = delay - age;
+    return false;
+}
+
+/*
+ * Priority class of a queued message: raised by one class each LORAWAN_TX_AGING_MS
+ */
+static uint8_t _lorawan_tx_prio(struct sock_el* sock_el, struct tx_msg* msg, os_time_t now){
+#if LORAWAN_TX_AGING_MS > 0
+    os_time_t aging = ( (os_time_t)LORAWAN_TX_AGING_MS * OS_TICKS_PER_SEC ) / 1000;
+    os_time_t steps = ( now - msg->aging_time ) / ( ( aging != 0 ) ? aging : 1 );
+
+    if( steps >= sock_el->prio )
+        return LORAWAN_PRIO_HIGHEST;
+    return sock_el->prio - steps;
+#else
+    return sock_el->prio;
+#endif
+}
+
+#define LORAWAN_QUOTA_PERIOD_MS     3600000UL
+
+/* Fixed point of the fair share order: vtime += airtime * LORAWAN_VTIME_SCALE / weight */
+#define LORAWAN_VTIME_SCALE         256
+
+void _lorawan_share_init(struct sock_el* sock_el){
+    struct sock_el* i_list;
+    bool found = false;
+    int i;
+
+    sock_el->weight = 1;
+    sock_el->quota = 0;
+    sock_el->quota_used = 0;
+    sock_el->quota_last = timer_get_us64() / 1000;
+
+    /* Start at the position of the least served socket: no credit for the past */
+    sock_el->vtime = 0;
+    for (i = 0; i < LORAWAN_SOCKET_MAX; i++) {
+        i_list = &l_sock_table[i];
+        if( ( i_list->sock == 0 )||( i_list == sock_el ) )
+            continue;
+        if( !found || ( (int32_t)(i_list->vtime - sock_el->vtime) < 0 ) ){
+            sock_el->vtime = i_list->vtime;
+            found = true;
+        }
+    }
+}
+
+void _lorawan_quota_refill(struct sock_el* sock_el){
+    uint64_t now = timer_get_us64() / 1000;
+    uint64_t refill;
+
+    if( sock_el->quota == 0 ){
+        sock_el->quota_used = 0;
+        sock_el->quota_last = now;
+        return;
+    }
+
+    /* quota ms per hour: refill by whole ms (no drift) */
+    refill = ( ( now - sock_el->quota_last ) * sock_el->quota ) / LORAWAN_QUOTA_PERIOD_MS;
+    if( refill >= sock_el->quota_used ){
+        sock_el->quota_used = 0;
+        sock_el->quota_last = now;
+    }
+    else{
+        sock_el->quota_used -= refill;
+        sock_el->quota_last += ( refill * LORAWAN_QUOTA_PERIOD_MS ) / sock_el->quota;
+    }
+}
+
+/*
+ * Delay before the quota of a socket allows a new frame (a frame may exceed the remaining quota,
+ * the debt delays the next ones)
+ * return: in ticks, 0 if the socket can send now
+ */
+static os_time_t _lorawan_quota_wait(struct sock_el* sock_el){
+    uint64_t wait_ms;
+    uint64_t ticks;
+
+    _lorawan_quota_refill(sock_el);
+    if( ( sock_el->quota == 0 )||( sock_el->quota_used < sock_el->quota ) )
+        return 0;
+
+    wait_ms = ( (uint64_t)( sock_el->quota_used - sock_el->quota + 1 ) * LORAWAN_QUOTA_PERIOD_MS ) / sock_el->quota;
+    ticks = ( (uint64_t)wait_ms * OS_TICKS_PER_SEC ) / 1000 + 1;
+
+    /* A tiny quota may give a delay longer than a callout can take: checked again on expiry */
+    return (os_time_t)( ( ticks > INT32_MAX ) ? INT32_MAX : ticks );
+}
+
+/*
+ * Charge the airtime of a frame to the socket which sent it
+ */
+static void _lorawan_share_consume(lorawan_sock_t sock, uint32_t airtime_ms){
+    struct sock_el* sock_el;
+    os_sr_t sr;
+
+    sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return;
+
+    OS_ENTER_CRITICAL(sr);
+    _lorawan_quota_refill(sock_el);
+    sock_el->tx_frames++;
+    sock_el->tx_airtime += airtime_ms;
+    sock_el->vtime += ( airtime_ms * LORAWAN_VTIME_SCALE ) / sock_el->weight;
+    if( sock_el->quota != 0 )
+        sock_el->quota_used += airtime_ms;
+    OS_EXIT_CRITICAL(sr);
+}
+
+/*
+ * Scheduling order: priority class, then earliest deadline (messages without deadline last),
+ * then least served socket (airtime / weight), then oldest
+ */
+static bool _lorawan_tx_before(struct sock_el* a_el, struct tx_msg* a, struct sock_el* b_el, struct tx_msg* b, os_time_t now){
+    uint8_t a_prio = _lorawan_tx_prio(a_el, a, now);
+    uint8_t b_prio = _lorawan_tx_prio(b_el, b, now);
+
+    if( a_prio != b_prio )
+        return ( a_prio < b_prio );
+    if( a->has_deadline && b->has_deadline && ( a->deadline != b->deadline ) )
+        return ( (int32_t)(a->deadline - b->deadline) < 0 );
+    if( a->has_deadline != b->has_deadline )
+        return a->has_deadline;
+    if( ( a_el != b_el )&&( a_el->vtime != b_el->vtime ) )
+        return ( (int32_t)(a_el->vtime - b_el->vtime) < 0 );
+    return ( (int32_t)(a->seq - b->seq) < 0 );
+}
+
+/*
+ * Find the next message to send among all sockets:
+ *   - the head of each socket queue (unless it waits for aggregation),
+ *   - and the messages with a deadline (not on aggregated ports), which may pass the older ones of their socket.
+ */
+static struct tx_msg* _lorawan_tx_peek(struct sock_el** p_sock_el, uint8_t max_payload, os_time_t* wait){
+    struct sock_el* i_list;
+    struct tx_msg* msg;
+    struct tx_msg* best = NULL;
+    os_time_t aggr_wait;
+    os_time_t quota_wait;
+    os_time_t now = os_time_get();
+    os_sr_t sr;
+    int i;
+
+    *wait = 0;
+
+    OS_ENTER_CRITICAL(sr);
+    for (i = 0; i < LORAWAN_SOCKET_MAX; i++) {
+        i_list = &l_sock_table[i];
+        if( ( i_list->sock == 0 )||STAILQ_EMPTY(&(i_list->tx_pending)) )
+            continue;
+
+        /* Over its quota: the socket is skipped until the quota is refilled */
+        quota_wait = _lorawan_quota_wait(i_list);
+        if( quota_wait != 0 ){
+            if( ( *wait == 0 ) || ( quota_wait < *wait ) )
+                *wait = quota_wait;
+            continue;
+        }
+
+        STAILQ_FOREACH(msg, &(i_list->tx_pending), tm_next){
+            if( msg == STAILQ_FIRST(&(i_list->tx_pending)) ){
+                /* An aggregated port waits for more messages: keep the earliest flush deadline */
+                if( LORAWAN_PORT_IS_SET(i_list->aggr_ports, msg->port) &&
+                    !_lorawan_tx_aggr_ready(i_list, msg, max_payload, &aggr_wait) ){
+                    if( ( *wait == 0 ) || ( aggr_wait < *wait ) )
+                        *wait = aggr_wait;
+                    continue;
+                }
+            }
+            else if( !msg->has_deadline || LORAWAN_PORT_IS_SET(i_list->aggr_ports, msg->port) ){
+                continue;
+            }
+
+            if( ( best == NULL ) || _lorawan_tx_before(i_list, msg, *p_sock_el, best, now) ){
+                best = msg;
+                *p_sock_el = i_list;
+            }
+        }
+    }
+    lorawan_tx_picked = ( best != NULL ) ? *p_sock_el : NULL;
+    OS_EXIT_CRITICAL(sr);
+
+    return best;
+}
+
+/*
+ * Give back a queued message of the socket to the free slots
+ */
+static void _lorawan_tx_release(struct sock_el* sock_el, struct tx_msg* msg){
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    STAILQ_REMOVE(&(sock_el->tx_pending), msg, tx_msg, tm_next);
+    STAILQ_INSERT_TAIL(&(sock_el->tx_free), msg, tm_next);
+    OS_EXIT_CRITICAL(sr);
+}
+
+/*
+ * Wake up all the threads waiting on the socket (lorawan_wait_*() and lorawan_poll())
+ */
+static void _lorawan_sock_signal(struct sock_el* sock_el){
+    struct lorawan_waiter* waiter;
+    os_sr_t sr;
+
+    /* The semaphores are on the stacks of the waiters: release them before the waiters can unregister */
+    OS_ENTER_CRITICAL(sr);
+    SLIST_FOREACH(waiter, &(sock_el->waiters), next)
+        os_sem_release(&(waiter->sem));
+    if( sock_el->poll_sem != NULL )
+        os_sem_release(sock_el->poll_sem);
+    OS_EXIT_CRITICAL(sr);
+}
+
+/*
+ * Record the completion of a message (in a critical section)
+ */
+static void _lorawan_tx_record(struct sock_el* sock_el, uint32_t msg_id, lorawan_event_t ev){
+    sock_el->tx_done[sock_el->tx_done_idx].id = msg_id;
+    sock_el->tx_done[sock_el->tx_done_idx].ev = ev;
+    sock_el->tx_done_idx = (sock_el->tx_done_idx + 1) % LORAWAN_TX_QUEUE_LEN;
+    sock_el->state = ev;
+    sock_el->poll_ev |= ev;
+}
+
+/*
+ * Drop a queued message (in a critical section): its slot is given back and its completion
+ * recorded at once, so that a message is always either queued, in flight or completed
+ */
+static void _lorawan_tx_drop(struct sock_el* sock_el, struct tx_msg* msg, lorawan_event_t ev){
+    STAILQ_REMOVE(&(sock_el->tx_pending), msg, tx_msg, tm_next);
+    STAILQ_INSERT_TAIL(&(sock_el->tx_free), msg, tm_next);
+    _lorawan_tx_record(sock_el, msg->id, ev);
+}
+
+/*
+ * Wake up the threads waiting on the socket, and report the recorded completions to the callback.
+ * Called out of any critical section: the callback may send again or close the socket.
+ */
+static void _lorawan_tx_notify(struct sock_el* sock_el){
+    _lorawan_sock_signal(sock_el);
+
+    /* Report the completions to the callback, on the selected event queue */
+    if( sock_el->on_tx_done != NULL ){
+        if( sock_el->cb_evq == NULL )
+            _lorawan_tx_cb_ev(&(sock_el->tx_cb_ev));
+        else
+            os_eventq_put(sock_el->cb_evq, &(sock_el->tx_cb_ev));
+    }
+}
+
+/*
+ * Record the completion of a message in flight, and wake up the threads waiting on the socket
+ */
+static void _lorawan_tx_complete(lorawan_sock_t sock, uint32_t msg_id, lorawan_event_t ev){
+    struct sock_el* sock_el;
+    os_sr_t sr;
+
+    /* The socket may have been closed in the meantime */
+    sock_el = _lorawan_find_el(sock);
+    if( sock_el == NULL )
+        return;
+
+    OS_ENTER_CRITICAL(sr);
+    _lorawan_tx_record(sock_el, msg_id, ev);
+    OS_EXIT_CRITICAL(sr);
+
+    _lorawan_tx_notify(sock_el);
+}
+
+void _lorawan_tx_cb_ev(struct os_event* ev){
+    struct sock_el* sock_el = ev->ev_arg;
+    lorawan_tx_done_cb_t on_tx_done;
+    struct tx_done done;
+    os_sr_t sr;
+
+    while(1){
+        OS_ENTER_CRITICAL(sr);
+        on_tx_done = sock_el->on_tx_done;
+        if( ( on_tx_done == NULL )||( sock_el->tx_cb_idx == sock_el->tx_done_idx ) ){
+            OS_EXIT_CRITICAL(sr);
+            break;
+        }
+        done = sock_el->tx_done[sock_el->tx_cb_idx];
+        sock_el->tx_cb_idx = (sock_el->tx_cb_idx + 1) % LORAWAN_TX_QUEUE_LEN;
+        OS_EXIT_CRITICAL(sr);
+
+        on_tx_done(sock_el->sock, done.id, done.ev, sock_el->cb_arg);
+    }
+}
+
+/*
+ * Give a received buffer to the on_rx callback of its socket, then release it
+ */
+static void _lorawan_rx_cb_ev(struct os_event* ev){
+    struct lorawan_rx_buf* buf = ev->ev_arg;
+    struct sock_el* sock_el;
+
+    /* The socket may have been closed, or its callback removed, in the meantime */
+    sock_el = _lorawan_find_el(buf->sock);
+    if( ( sock_el != NULL )&&( sock_el->on_rx != NULL ) )
+        sock_el->on_rx(buf->sock, buf, sock_el->cb_arg);
+
+    lorawan_buf_release(buf);
+}
+
+lorawan_event_t _lorawan_tx_state(struct sock_el* sock_el, uint32_t msg_id){
+    struct tx_msg* msg;
+    lorawan_event_t ev = LORAWAN_EVENT_UNKNOWN;
+    os_sr_t sr;
+    int i;
+
+    if( msg_id == 0 )
+        return LORAWAN_EVENT_NONE;
+
+    OS_ENTER_CRITICAL(sr);
+    for(i=0; i<LORAWAN_TX_QUEUE_LEN; i++){
+        if( sock_el->tx_done[i].id == msg_id ){
+            ev = sock_el->tx_done[i].ev;
+            goto out;
+        }
+    }
+
+    /* Not completed yet: not queued yet, still queued, or in flight */
+    if( (int32_t)(msg_id - sock_el->tx_next_id) >= 0 ){
+        ev = LORAWAN_EVENT_NONE;
+        goto out;
+    }
+    STAILQ_FOREACH(msg, &(sock_el->tx_pending), tm_next){
+        if( msg->id == msg_id ){
+            ev = LORAWAN_EVENT_NONE;
+            goto out;
+        }
+    }
+    if( lorawan_tx_inflight.busy && ( lorawan_tx_inflight.sock == sock_el->sock ) ){
+        for(i=0; i<lorawan_tx_inflight.nb_ids; i++){
+            if( lorawan_tx_inflight.ids[i] == msg_id ){
+                ev = LORAWAN_EVENT_NONE;
+                goto out;
+            }
+        }
+    }
+
+    /* Otherwise, its completion has been overwritten by newer ones */
+out:
+    OS_EXIT_CRITICAL(sr);
+
+    return ev;
+}
+
+/*
+ * Replace policy: drop the queued messages followed by a newer one on the same port (LORAWAN_EVENT_DROPPED).
+ * The newer message takes the place of the older one in the schedule, and keeps its aging:
+ * a socket updated faster than LORAWAN_TX_AGING_MS is still promoted.
+ * Fallback of the replace done by _lorawan_tx_commit, for the messages queued while the drain
+ * was sending from their socket, or before the policy was set.
+ * Run on the LoRaWAN task only: no message is being sent meanwhile.
+ */
+static void _lorawan_tx_replace(void){
     struct sock_el* i_list;
+    struct sock_el* sock_el;
+    struct tx_msg* msg;
+    struct tx_msg* newer;
+    struct tx_msg* replaced;
+    os_sr_t sr;
+    int i;
+
+    do{
+        replaced = NULL;
+        sock_el = NULL;
+
+        OS_ENTER_CRITICAL(sr);
+        for (i = 0; ( i < LORAWAN_SOCKET_MAX )&&( replaced == NULL ); i++) {
+            i_list = &l_sock_table[i];
+            if( ( i_list->sock == 0 )||!( i_list->queue_policy & LORAWAN_QUEUE_REPLACE ) )
+                continue;
+            STAILQ_FOREACH(msg, &(i_list->tx_pending), tm_next){
+                for(newer = STAILQ_NEXT(msg, tm_next); newer != NULL; newer = STAILQ_NEXT(newer, tm_next)){
+                    if( newer->port == msg->port )
+                        break;
+                }
+                if( newer != NULL ){
+                    replaced = msg;
+                    sock_el = i_list;
+                    break;
+                }
+            }
+        }
+        if( replaced != NULL ){
+            /* The position and the aging, not the TTL (counted from the enqueue of each message) */
+            newer->seq = replaced->seq;
+            newer->aging_time = replaced->aging_time;
+            STAILQ_REMOVE(&(sock_el->tx_pending), newer, tx_msg, tm_next);
+            STAILQ_INSERT_AFTER(&(sock_el->tx_pending), replaced, newer, tm_next);
+            _lorawan_tx_drop(sock_el, replaced, LORAWAN_EVENT_DROPPED);
+            sock_el->tx_replaced++;
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        if( replaced != NULL )
+            _lorawan_tx_notify(sock_el);
+    } while( replaced != NULL );
+}
+
+/*
+ * Drop the queued messages whose deadline or TTL is passed (LORAWAN_EVENT_EXPIRED),
+ * and arm the deadline callout on the next one
+ */
+static void _lorawan_tx_expire(void){
+    struct sock_el* i_list;
+    struct sock_el* sock_el;
+    struct tx_msg* msg;
+    struct tx_msg* expired;
+    os_time_t now;
+    os_time_t next = 0;
+    os_time_t exp;
+    os_time_t ttl_exp;
+    bool has_exp;
+    bool by_ttl;
+    bool has_next;
+    os_sr_t sr;
+    int i;
+
+    do{
+        expired = NULL;
+        sock_el = NULL;
+        has_next = false;
+        now = os_time_get();
+
+        OS_ENTER_CRITICAL(sr);
+        for (i = 0; ( i < LORAWAN_SOCKET_MAX )&&( expired == NULL ); i++) {
+            i_list = &l_sock_table[i];
+            if( i_list->sock == 0 )
+                continue;
+            STAILQ_FOREACH(msg, &(i_list->tx_pending), tm_next){
+                /* Earliest of the deadline and the TTL */
+                has_exp = msg->has_deadline;
+                exp = msg->deadline;
+                by_ttl = false;
+                if( i_list->queue_policy & LORAWAN_QUEUE_TTL ){
+                    ttl_exp = msg->time + i_list->ttl;
+                    if( !has_exp || ( (int32_t)(ttl_exp - exp) < 0 ) ){
+                        exp = ttl_exp;
+                        has_exp = true;
+                        by_ttl = true;
+                    }
+                }
+                if( !has_exp )
+                    continue;
+                if( (int32_t)(now - exp) >= 0 ){
+                    expired = msg;
+                    sock_el = i_list;
+                    break;
+                }
+                if( !has_next || ( (int32_t)(exp - next) < 0 ) ){
+                    next = exp;
+                    has_next = true;
+                }
+            }
+        }
+        if( expired != NULL ){
+            _lorawan_tx_drop(sock_el, expired, LORAWAN_EVENT_EXPIRED);
+            if( by_ttl )
+                sock_el->tx_ttl_drops++;
+            else
+                sock_el->tx_expired++;
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        if( expired != NULL )
+            _lorawan_tx_notify(sock_el);
+    } while( expired != NULL );
+
+    if( has_next )
+        os_callout_reset(&lorawan_tx_deadline, next - now);
+    else
+        os_callout_stop(&lorawan_tx_deadline);
+}
+
+/*
+ * Send the next queued message (see _lorawan_tx_peek), if the MAC is idle
+ */
+static void _lorawan_tx_send(void){
+    struct sock_el* sock_el;
+    struct tx_msg* batch[LORAWAN_TX_QUEUE_LEN];
+    struct tx_msg* msg;
+    McpsReq_t mcps_req;
+    LoRaMacStatus_t status;
+    uint8_t max_payload;
+    uint8_t* buffer;
+    uint8_t size;
+    uint8_t nb = 0;
+    os_time_t wait;
+#if MYNEWT_VAL(LORAWAN_DC_LEDGER)
+    uint32_t dc_wait;
+#endif
+    os_sr_t sr;
+    int i;
+
+    /* Apply the queue policies, and report the expired messages, even while the MAC is busy */
+    _lorawan_tx_replace();
+    _lorawan_tx_expire();
+
+    /* Wait for the McpsConfirm of the previous message */
+    if( lorawan_tx_inflight.busy )
+        return;
 
-    /* Find the matching element */
-    for (i_list = SLIST_FIRST(&l_sock_list); i_list != NULL; i_list = SLIST_NEXT(i_list, sc_next)) {
-        if (i_list->sock == sock)
+    max_payload = _lorawan_tx_max_payload();
+
+    msg = _lorawan_tx_peek(&sock_el, max_payload, &wait);
+    if( msg == NULL ){
+        /* Come back when the delay of the oldest aggregated message is elapsed (or a quota is refilled) */
+        if( wait != 0 )
+            os_callout_reset(&lorawan_tx_flush, wait);
+        return;
+    }
+
+    /* A message too big to be framed at the current datarate is sent alone, unframed */
+    if( LORAWAN_PORT_IS_SET(sock_el->aggr_ports, msg->port) && ( 1 + msg->size <= max_payload ) ){
+        /* Pack the following messages of the port: 1 byte length + payload for each one */
+        size = 0;
+        OS_ENTER_CRITICAL(sr);
+        for(; msg != NULL; msg = STAILQ_NEXT(msg, tm_next)){
+            if( ( ( nb != 0 )&&( msg->port != batch[0]->port ) )||( size + 1 + msg->size > max_payload ) )
+                break;
+            batch[nb++] = msg;
+            size += 1 + msg->size;
+        }
+        OS_EXIT_CRITICAL(sr);
+
+        size = 0;
+        for(i=0; i<nb; i++){
+            lorawan_tx_frame[size++] = batch[i]->size;
+            memcpy(&lorawan_tx_frame[size], batch[i]->payload, batch[i]->size);
+            size += batch[i]->size;
+        }
+        buffer = lorawan_tx_frame;
+    }
+    else{
+        batch[nb++] = msg;
+        buffer = msg->payload;
+        size = msg->size;
+    }
+
+#if MYNEWT_VAL(LORAWAN_DC_LEDGER)
+    /* Hold the frame (and the queue) until the duty cycle of a band allows it */
+    dc_wait = _lorawan_dc_wait_ms(_lorawan_airtime_ms(_lorawan_tx_datarate(sock_el), size));
+    if( dc_wait != 0 ){
+        os_callout_reset(&lorawan_tx_retry, (os_time_t)( ( (uint64_t)dc_wait * OS_TICKS_PER_SEC + 999 ) / 1000 ));
+        return;
+    }
+#endif
+
+    mcps_req = sock_el->mcps_req;
+    if(mcps_req.Type == MCPS_CONFIRMED){
+        mcps_req.Req.Confirmed.fBuffer = buffer;
+        mcps_req.Req.Confirmed.fBufferSize = size;
+        mcps_req.Req.Confirmed.fPort = batch[0]->port;
+    }
+    else{
+        mcps_req.Req.Unconfirmed.fBuffer = buffer;
+        mcps_req.Req.Unconfirmed.fBufferSize = size;
+        mcps_req.Req.Unconfirmed.fPort = batch[0]->port;
+    }
+
+    /* The MAC copies the payload into its own frame buffer */
+    status = LoRaMacMcpsRequest( &mcps_req );
+
+    switch(status){
+        case LORAMAC_STATUS_OK:
+            lorawan_tx_inflight.busy = true;
+            lorawan_tx_inflight.sock = sock_el->sock;
+            lorawan_tx_inflight.nb_ids = nb;
+            for(i=0; i<nb; i++){
+                lorawan_tx_inflight.ids[i] = batch[i]->id;
+                _lorawan_tx_release(sock_el, batch[i]);
+            }
+            break;
+        case LORAMAC_STATUS_BUSY:
+        case LORAMAC_STATUS_NO_NETWORK_JOINED:
+            /* Keep the messages in the queue, and try again later */
+            os_callout_reset(&lorawan_tx_retry, (LORAWAN_TX_RETRY_MS*OS_TICKS_PER_SEC)/1000);
+            break;
+        default:
+            /* These messages will never be accepted by the MAC: drop them, and go on with the next ones */
+            printf("Tx dropped (%d)\r\n", status);
+            /* Release all the slots before reporting: the callback may send again or close the socket */
+            OS_ENTER_CRITICAL(sr);
+            for(i=0; i<nb; i++)
+                _lorawan_tx_drop(sock_el, batch[i], LORAWAN_EVENT_ERROR);
+            OS_EXIT_CRITICAL(sr);
+            _lorawan_tx_notify(sock_el);
+            os_eventq_put(os_eventq_lorawan_get(), &lorawan_tx_ev);
             break;
     }
-    /* If a valid sock has been found, the struct ptr is returned */
-    /* If no valid sock has been found, the last value is NULL, and is returned */
-    return i_list;
+}
+
+static void _lorawan_tx_drain(struct os_event* ev){
+    os_sr_t sr;
+
+    _lorawan_tx_send();
+
+    /* The picked messages are handed to the MAC, dropped, or left in the queue */
+    OS_ENTER_CRITICAL(sr);
+    lorawan_tx_picked = NULL;
+    OS_EXIT_CRITICAL(sr);
 }
 
 /* Primitive definitions used by the LoRaWAN */
 static void _mcps_confirm ( McpsConfirm_t *McpsConfirm ){
+    MibRequestConfirm_t mibReq;
+    lorawan_event_t ev;
+    uint8_t nb_tx;
+    int i;
     printf("MCPSconfirm: %d\r\n", McpsConfirm->AckReceived);
+
+    /* Airtime of the frame: each transmission of a confirmed frame, each repetition (NbRep)
+     * of an unconfirmed one (repetitions cut short by a downlink are still charged) */
+    if( McpsConfirm->McpsRequest == MCPS_CONFIRMED ){
+        nb_tx = McpsConfirm->NbRetries;
+    }
+    else{
+        mibReq.Type = MIB_CHANNELS_NB_REP;
+        nb_tx = ( LoRaMacMibGetRequestConfirm( &mibReq ) == LORAMAC_STATUS_OK ) ? mibReq.Param.ChannelNbRep : 1;
+    }
+    if( nb_tx == 0 )
+        nb_tx = 1;
+#if MYNEWT_VAL(LORAWAN_DC_LEDGER)
+    _lorawan_dc_consume(McpsConfirm->Channel, McpsConfirm->TxTimeOnAir, nb_tx);
+#endif
+
+    /* Report the completion to the socket which sent the message */
+    if( lorawan_tx_inflight.busy ){
+        _lorawan_share_consume(lorawan_tx_inflight.sock, McpsConfirm->TxTimeOnAir * nb_tx);
+
+        if( McpsConfirm->Status == LORAMAC_EVENT_INFO_STATUS_OK ){
+            ev = LORAWAN_EVENT_SENT;
+            if( McpsConfirm->AckReceived )
+                ev |= LORAWAN_EVENT_ACK;
+        }
+        else{
+            ev = LORAWAN_EVENT_ERROR;
+        }
+        for(i=0; i<lorawan_tx_inflight.nb_ids; i++)
+            _lorawan_tx_complete(lorawan_tx_inflight.sock, lorawan_tx_inflight.ids[i], ev);
+    }
+
+    /* The MAC is idle again: send the next queued message, else prepare the next one */
+    lorawan_tx_inflight.busy = false;
+    os_eventq_put(os_eventq_lorawan_get(), &lorawan_tx_ev);
+    _lorawan_tx_prepare();
 }
 
 static void _mcps_indication ( McpsIndication_t *McpsIndication ){
     struct sock_el* i_list;
-    struct os_event* ev;
+    struct lorawan_rx_buf* buf;
     printf("MCPSind (%d)\r\n", McpsIndication->Status);
 
     if( McpsIndication->Status != LORAMAC_EVENT_INFO_STATUS_OK){
@@ -93,23 +1218,63 @@ static void _mcps_indication ( McpsIndication_t *McpsIndication ){
 #endif
 
     /* Search for a valid socket on the devAddr/port */
-    i_list = _lorawan_find_el( lorawan_find_sock_by_params(McpsIndication->DevAddr, McpsIndication->Port) );
+    i_list = _lorawan_demux_find(McpsIndication->DevAddr, McpsIndication->Port);
 
     if(i_list == NULL){ //drop the packet, no match...
         return;
     }
 
-    ev = malloc( sizeof(struct os_event) );
-    if(ev != NULL){
-        ev->ev_arg = McpsIndication;//TODO: memcpy data to allow multiple treatments.
-        ev->ev_queued = 0;
-        os_eventq_put(&(i_list->sock_eventq), ev);
+    if(McpsIndication->BufferSize > LORAWAN_RX_PAYLOAD_MAX){
+        printf("Rx too big\r\n");
+        return;
+    }
+
+    buf = os_memblock_get(&lorawan_rx_pool);
+    if(buf == NULL){ //drop the packet, all buffers are in use...
+        lorawan_rx_drop_no_buf++;
+        printf("No Rx buffer\r\n");
+        return;
+    }
+
+    /* The only copy of the data: McpsIndication is owned by the MAC */
+    buf->devAddr = McpsIndication->DevAddr;
+    buf->port = McpsIndication->Port;
+    buf->size = McpsIndication->BufferSize;
+    buf->payload = (uint8_t*)(buf + 1);
+    buf->rssi = McpsIndication->Rssi;
+    buf->snr = (int8_t)McpsIndication->Snr;
+    buf->multicast = McpsIndication->Multicast;
+    buf->downlink_counter = McpsIndication->DownLinkCounter;
+    memcpy(buf->payload, McpsIndication->Buffer, McpsIndication->BufferSize);
+
+    buf->sock = i_list->sock;
+    buf->refcnt = 1;
+    buf->ev.ev_queued = 0;
+    buf->ev.ev_arg = buf;
+
+    /* Give the buffer to the callback of the socket, if any */
+    if( i_list->on_rx != NULL ){
+        buf->ev.ev_cb = _lorawan_rx_cb_ev;
+        if( i_list->cb_evq == NULL )
+            _lorawan_rx_cb_ev(&(buf->ev));
+        else
+            os_eventq_put(i_list->cb_evq, &(buf->ev));
+        return;
     }
 
+    /* The reference is owned by the socket queue, until the buffer is read */
+    buf->ev.ev_cb = NULL;
+    os_eventq_put(&(i_list->sock_eventq), &(buf->ev));
+
+    /* Wake up the threads waiting for a LORAWAN_EVENT_PENDING_RX */
+    _lorawan_sock_signal(i_list);
 }
 
 static void _mlme_confirm( MlmeConfirm_t *MlmeConfirm ){
     printf("MLMEconf\r\n");
+
+    /* Messages may have been refused while the MLME request was in progress */
+    os_eventq_put(os_eventq_lorawan_get(), &lorawan_tx_ev);
 }
 
 static void _mlme_indication( MlmeIndication_t *MlmeIndication ){
@@ -138,12 +1303,117 @@ static LoRaMacRegion_t lorawan_get_first_active_region( void ){
     return 0;
 }
 
+LoRaMacRegion_t _lorawan_region(void){
+    return lorawan_get_first_active_region();
+}
+
+/*
+ * LoRa parameters of an uplink datarate in the active region
+ * return: false if it is not a LoRa datarate (e.g. FSK)
+ */
+static bool _lorawan_dr_params(int8_t dr, uint8_t* sf, uint8_t* bw){
+    switch( lorawan_get_first_active_region() ){
+    case LORAMAC_REGION_US915:
+    case LORAMAC_REGION_US915_HYBRID:
+        if( ( dr >= DR_0 ) && ( dr <= DR_3 ) ){
+            *sf = 10 - dr;
+            *bw = 0;
+        }
+        else if( dr == DR_4 ){
+            *sf = 8;
+            *bw = 2;
+        }
+        else
+            return false;
+        break;
+    case LORAMAC_REGION_AU915:
+        if( ( dr >= DR_0 ) && ( dr <= DR_5 ) ){
+            *sf = 12 - dr;
+            *bw = 0;
+        }
+        else if( dr == DR_6 ){
+            *sf = 8;
+            *bw = 2;
+        }
+        else
+            return false;
+        break;
+    default:
+        /* EU868 like: DR_7 is FSK */
+        if( ( dr >= DR_0 ) && ( dr <= DR_5 ) ){
+            *sf = 12 - dr;
+            *bw = 0;
+        }
+        else if( dr == DR_6 ){
+            *sf = 7;
+            *bw = 1;
+        }
+        else
+            return false;
+        break;
+    }
+    return true;
+}
+
+int8_t _lorawan_tx_datarate(struct sock_el* sock_el){
+    MibRequestConfirm_t mibReq;
+
+    /* The datarate of the request is ignored by the MAC if the ADR is on */
+    mibReq.Type = MIB_ADR;
+    if( ( LoRaMacMibGetRequestConfirm( &mibReq ) == LORAMAC_STATUS_OK ) && mibReq.Param.AdrEnable ){
+        mibReq.Type = MIB_CHANNELS_DATARATE;
+        if( LoRaMacMibGetRequestConfirm( &mibReq ) == LORAMAC_STATUS_OK )
+            return mibReq.Param.ChannelsDatarate;
+    }
+
+    if( sock_el->mcps_req.Type == MCPS_CONFIRMED )
+        return sock_el->mcps_req.Req.Confirmed.Datarate;
+    else
+        return sock_el->mcps_req.Req.Unconfirmed.Datarate;
+}
+
+uint32_t _lorawan_airtime_ms(int8_t dr, uint8_t payload_size){
+    uint8_t sf;
+    uint8_t bw;
+    bool ldro;
+
+    if( payload_size > UINT8_MAX - LORAWAN_FRAME_OVERHEAD )
+        return 0;
+    if( !_lorawan_dr_params(dr, &sf, &bw) )
+        return 0;
+
+    /* Set by the radio drivers when the symbol time reaches 16ms */
+    ldro = ( ( bw == 0 ) && ( sf >= 11 ) ) || ( ( bw == 1 ) && ( sf == 12 ) );
+
+    /* Uplink: preamble of 8 symbols, CR 4/5, explicit header, CRC on */
+    return lora_time_on_air_ms(sf, bw, 1, 8, false, true, ldro, payload_size + LORAWAN_FRAME_OVERHEAD);
+}
+
 void lorawan_api_private_init(void){
     LoRaMacStatus_t status;
+    os_error_t rc;
 
     /* Initialize the LoRaWAN event queue */
     os_eventq_init( os_eventq_lorawan_get() );
 
+    /* Initialize the downlink buffers pool */
+    rc = os_mempool_init(&lorawan_rx_pool, LORAWAN_RX_BUF_COUNT, LORAWAN_RX_BUF_SIZE,
+                         lorawan_rx_pool_mem, "lorawan_rx");
+    assert(rc == OS_OK);
+
+    /* Initialize the multicast parameters pool */
+    rc = os_mempool_init(&lorawan_mcast_pool, LORAWAN_MULTICAST_MAX, sizeof(MulticastParams_t),
+                         lorawan_mcast_pool_mem, "lorawan_mcast");
+    assert(rc == OS_OK);
+
+    /* Initialize the uplink scheduler */
+    os_callout_init(&lorawan_tx_retry, os_eventq_lorawan_get(), _lorawan_tx_drain, NULL);
+    os_callout_init(&lorawan_tx_flush, os_eventq_lorawan_get(), _lorawan_tx_drain, NULL);
+    os_callout_init(&lorawan_tx_deadline, os_eventq_lorawan_get(), _lorawan_tx_drain, NULL);
+#if MYNEWT_VAL(LORAWAN_DC_LEDGER)
+    _lorawan_dc_init();
+#endif
+
     /* Create the LoRaWAN to treat the event queue */
     os_task_init(&lorawan_eventq_task, "lw_eventq", lorawan_eventq_thread, NULL,
                        LORAWAN_TASK_PRIO, OS_WAIT_FOREVER,
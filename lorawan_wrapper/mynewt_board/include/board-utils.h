@@ -21,7 +21,78 @@
 #define __BOARD_UTILS_H__
 
 #include "gpio.h"
+#include "spi.h"
+#include "os/os.h"
 
 void gpio_struct_init(Gpio_t *, PinNames, PinModes, PinConfigs, PinTypes);
 
+/*
+ * Burst SPI transfer (one HAL call for the whole buffer)
+ *   - txBuffer = NULL: read only, zeros are sent
+ *   - rxBuffer = NULL: write only, the received bytes are dropped
+ */
+void SpiInOutBuffer(Spi_t *obj, const uint8_t *txBuffer, uint8_t *rxBuffer, uint16_t size);
+
+/* Static slots of the wrapper timers */
+void timer_slots_get(uint16_t *total, uint16_t *used);
+
+/* Monotonic timebase of the wrapper timers (in microseconds since boot) */
+uint64_t timer_get_us64(void);
+
+/*
+ * Get the timestamp (os_cputime) of the radio IRQ edge being handled.
+ * return: false if no IRQ handler is running
+ */
+bool gpio_irq_timestamp_get(uint32_t *ts);
+
+/* Number of IRQ edges whose timestamp was lost (ring full) */
+uint32_t gpio_irq_overflows_get(void);
+
+/* Number of radio commands whose BUSY line was not released within SX126X_BUSY_TIMEOUT_MS */
+uint32_t radio_busy_timeouts_get(void);
+
+/*
+ * Time on air of a LoRa frame, integer arithmetic only:
+ *   - sf: 6..12, bw: 0 = 125kHz, 1 = 250kHz, 2 = 500kHz, cr: 1 = 4/5 .. 4 = 4/8
+ *   - fixLen: implicit header, ldro: low datarate optimization
+ *   - pktLen: PHY payload size (in bytes)
+ * return: 0 if the parameters are not supported
+ */
+uint32_t lora_time_on_air_us(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble,
+                             bool fixLen, bool crcOn, bool ldro, uint8_t pktLen);
+uint32_t lora_time_on_air_ms(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble,
+                             bool fixLen, bool crcOn, bool ldro, uint8_t pktLen);
+
+/*
+ * AES-128 block encryption offload (hardware engine of the BSP):
+ *   - key: raw 128 bits key, in: plaintext block, out: ciphertext block
+ *   - return: 0 if the block was encrypted, else the software AES is used
+ *     (e.g. engine busy)
+ * May be called from the LoRaWAN task and from the API tasks.
+ * Not used with LORAWAN_CRYPTO_STOCK. NULL = software AES only.
+ */
+typedef int (*aes_hw_encrypt_t)(const uint8_t key[16], const uint8_t in[16], uint8_t out[16]);
+void aes_hw_register(aes_hw_encrypt_t encrypt);
+
+/*
+ * Session key cache (LORAWAN_KEY_CACHE_LEN entries): the AES schedule and the
+ * CMAC subkeys of a key are computed once, when it is installed.
+ *   - owner: identifies the key (e.g. its storage): a new key of the same
+ *     owner replaces the previous one,
+ *   - key: NULL to remove the key of the owner.
+ * If the cache is full, the key is still usable (computed for each frame).
+ */
+void aes_key_cache_set(const void *owner, const uint8_t *key);
+
+/*
+ * Precompute the FRMPayload keystream of the next uplink (up to size bytes,
+ * LORAWAN_KEYSTREAM_BLOCKS blocks at most), with the cached key of owner.
+ * The encryption of this frame is then a XOR. Any previous keystream is dropped.
+ */
+void aes_keystream_prepare(const void *owner, uint32_t devAddr, uint32_t fcnt, uint8_t size);
+
+/* Internal to the AES/CMAC backend */
+bool aes_key_cache_subkeys(const uint8_t *key, uint8_t *k1, uint8_t *k2);
+void aes_cmac_shift(const uint8_t *in, uint8_t *out);
+
 #endif // __BOARD_UTILS_H__
@@ -0,0 +1,488 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Word-oriented AES-128 encryption (replaces the byte-oriented aes.c of the
+ * stack, which keeps the aes.h interface and context layout):
+ *   - the state is handled as 4 big endian 32 bits columns,
+ *   - SubBytes + ShiftRows + MixColumns are merged in a 1KB table (Te0),
+ *     rotated for the 3 other rows,
+ *   - the round keys are stored in ctx->ksch as big endian words, the first
+ *     one being the raw key (given to the hardware engine, if any).
+ * Only the encryption is needed by LoRaWAN (the join accept is "decrypted"
+ * with aes_encrypt).
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "syscfg/syscfg.h"
+#include "os/os.h"
+#include "aes.h"
+#include "board-utils.h"
+
+#if !MYNEWT_VAL(LORAWAN_CRYPTO_STOCK)
+
+#define AES_KEY_LEN             16
+#define AES_ROUNDS              10
+#define AES_KSCH_LEN            ( ( AES_ROUNDS + 1 ) * N_BLOCK )
+
+#define GETU32(p)   ( ( (uint32_t)(p)[0] << 24 ) | ( (uint32_t)(p)[1] << 16 ) | \
+                      ( (uint32_t)(p)[2] << 8 ) | ( (uint32_t)(p)[3] ) )
+#define PUTU32(p, v) do { (p)[0] = (uint8_t)( (v) >> 24 ); (p)[1] = (uint8_t)( (v) >> 16 ); \
+                          (p)[2] = (uint8_t)( (v) >> 8 ); (p)[3] = (uint8_t)(v); } while (0)
+#define ROTR(x, n)  ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+/* Te0[x] = { 2.S[x], S[x], S[x], 3.S[x] } */
+static const uint8_t AesSbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+static const uint32_t AesTe0[256] = {
+    0xc66363a5UL, 0xf87c7c84UL, 0xee777799UL, 0xf67b7b8dUL,
+    0xfff2f20dUL, 0xd66b6bbdUL, 0xde6f6fb1UL, 0x91c5c554UL,
+    0x60303050UL, 0x02010103UL, 0xce6767a9UL, 0x562b2b7dUL,
+    0xe7fefe19UL, 0xb5d7d762UL, 0x4dababe6UL, 0xec76769aUL,
+    0x8fcaca45UL, 0x1f82829dUL, 0x89c9c940UL, 0xfa7d7d87UL,
+    0xeffafa15UL, 0xb25959ebUL, 0x8e4747c9UL, 0xfbf0f00bUL,
+    0x41adadecUL, 0xb3d4d467UL, 0x5fa2a2fdUL, 0x45afafeaUL,
+    0x239c9cbfUL, 0x53a4a4f7UL, 0xe4727296UL, 0x9bc0c05bUL,
+    0x75b7b7c2UL, 0xe1fdfd1cUL, 0x3d9393aeUL, 0x4c26266aUL,
+    0x6c36365aUL, 0x7e3f3f41UL, 0xf5f7f702UL, 0x83cccc4fUL,
+    0x6834345cUL, 0x51a5a5f4UL, 0xd1e5e534UL, 0xf9f1f108UL,
+    0xe2717193UL, 0xabd8d873UL, 0x62313153UL, 0x2a15153fUL,
+    0x0804040cUL, 0x95c7c752UL, 0x46232365UL, 0x9dc3c35eUL,
+    0x30181828UL, 0x379696a1UL, 0x0a05050fUL, 0x2f9a9ab5UL,
+    0x0e070709UL, 0x24121236UL, 0x1b80809bUL, 0xdfe2e23dUL,
+    0xcdebeb26UL, 0x4e272769UL, 0x7fb2b2cdUL, 0xea75759fUL,
+    0x1209091bUL, 0x1d83839eUL, 0x582c2c74UL, 0x341a1a2eUL,
+    0x361b1b2dUL, 0xdc6e6eb2UL, 0xb45a5aeeUL, 0x5ba0a0fbUL,
+    0xa45252f6UL, 0x763b3b4dUL, 0xb7d6d661UL, 0x7db3b3ceUL,
+    0x5229297bUL, 0xdde3e33eUL, 0x5e2f2f71UL, 0x13848497UL,
+    0xa65353f5UL, 0xb9d1d168UL, 0x00000000UL, 0xc1eded2cUL,
+    0x40202060UL, 0xe3fcfc1fUL, 0x79b1b1c8UL, 0xb65b5bedUL,
+    0xd46a6abeUL, 0x8dcbcb46UL, 0x67bebed9UL, 0x7239394bUL,
+    0x944a4adeUL, 0x984c4cd4UL, 0xb05858e8UL, 0x85cfcf4aUL,
+    0xbbd0d06bUL, 0xc5efef2aUL, 0x4faaaae5UL, 0xedfbfb16UL,
+    0x864343c5UL, 0x9a4d4dd7UL, 0x66333355UL, 0x11858594UL,
+    0x8a4545cfUL, 0xe9f9f910UL, 0x04020206UL, 0xfe7f7f81UL,
+    0xa05050f0UL, 0x783c3c44UL, 0x259f9fbaUL, 0x4ba8a8e3UL,
+    0xa25151f3UL, 0x5da3a3feUL, 0x804040c0UL, 0x058f8f8aUL,
+    0x3f9292adUL, 0x219d9dbcUL, 0x70383848UL, 0xf1f5f504UL,
+    0x63bcbcdfUL, 0x77b6b6c1UL, 0xafdada75UL, 0x42212163UL,
+    0x20101030UL, 0xe5ffff1aUL, 0xfdf3f30eUL, 0xbfd2d26dUL,
+    0x81cdcd4cUL, 0x180c0c14UL, 0x26131335UL, 0xc3ecec2fUL,
+    0xbe5f5fe1UL, 0x359797a2UL, 0x884444ccUL, 0x2e171739UL,
+    0x93c4c457UL, 0x55a7a7f2UL, 0xfc7e7e82UL, 0x7a3d3d47UL,
+    0xc86464acUL, 0xba5d5de7UL, 0x3219192bUL, 0xe6737395UL,
+    0xc06060a0UL, 0x19818198UL, 0x9e4f4fd1UL, 0xa3dcdc7fUL,
+    0x44222266UL, 0x542a2a7eUL, 0x3b9090abUL, 0x0b888883UL,
+    0x8c4646caUL, 0xc7eeee29UL, 0x6bb8b8d3UL, 0x2814143cUL,
+    0xa7dede79UL, 0xbc5e5ee2UL, 0x160b0b1dUL, 0xaddbdb76UL,
+    0xdbe0e03bUL, 0x64323256UL, 0x743a3a4eUL, 0x140a0a1eUL,
+    0x924949dbUL, 0x0c06060aUL, 0x4824246cUL, 0xb85c5ce4UL,
+    0x9fc2c25dUL, 0xbdd3d36eUL, 0x43acacefUL, 0xc46262a6UL,
+    0x399191a8UL, 0x319595a4UL, 0xd3e4e437UL, 0xf279798bUL,
+    0xd5e7e732UL, 0x8bc8c843UL, 0x6e373759UL, 0xda6d6db7UL,
+    0x018d8d8cUL, 0xb1d5d564UL, 0x9c4e4ed2UL, 0x49a9a9e0UL,
+    0xd86c6cb4UL, 0xac5656faUL, 0xf3f4f407UL, 0xcfeaea25UL,
+    0xca6565afUL, 0xf47a7a8eUL, 0x47aeaee9UL, 0x10080818UL,
+    0x6fbabad5UL, 0xf0787888UL, 0x4a25256fUL, 0x5c2e2e72UL,
+    0x381c1c24UL, 0x57a6a6f1UL, 0x73b4b4c7UL, 0x97c6c651UL,
+    0xcbe8e823UL, 0xa1dddd7cUL, 0xe874749cUL, 0x3e1f1f21UL,
+    0x964b4bddUL, 0x61bdbddcUL, 0x0d8b8b86UL, 0x0f8a8a85UL,
+    0xe0707090UL, 0x7c3e3e42UL, 0x71b5b5c4UL, 0xcc6666aaUL,
+    0x904848d8UL, 0x06030305UL, 0xf7f6f601UL, 0x1c0e0e12UL,
+    0xc26161a3UL, 0x6a35355fUL, 0xae5757f9UL, 0x69b9b9d0UL,
+    0x17868691UL, 0x99c1c158UL, 0x3a1d1d27UL, 0x279e9eb9UL,
+    0xd9e1e138UL, 0xebf8f813UL, 0x2b9898b3UL, 0x22111133UL,
+    0xd26969bbUL, 0xa9d9d970UL, 0x078e8e89UL, 0x339494a7UL,
+    0x2d9b9bb6UL, 0x3c1e1e22UL, 0x15878792UL, 0xc9e9e920UL,
+    0x87cece49UL, 0xaa5555ffUL, 0x50282878UL, 0xa5dfdf7aUL,
+    0x038c8c8fUL, 0x59a1a1f8UL, 0x09898980UL, 0x1a0d0d17UL,
+    0x65bfbfdaUL, 0xd7e6e631UL, 0x844242c6UL, 0xd06868b8UL,
+    0x824141c3UL, 0x299999b0UL, 0x5a2d2d77UL, 0x1e0f0f11UL,
+    0x7bb0b0cbUL, 0xa85454fcUL, 0x6dbbbbd6UL, 0x2c16163aUL,
+};
+
+static const uint8_t AesRcon[AES_ROUNDS] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+};
+
+static volatile aes_hw_encrypt_t AesHwEncrypt = NULL;
+
+void aes_hw_register(aes_hw_encrypt_t encrypt)
+{
+    AesHwEncrypt = encrypt;
+}
+
+/* SubWord of the key expansion */
+static uint32_t aes_sub_word(uint32_t w)
+{
+    return ( (uint32_t)AesSbox[w >> 24] << 24 ) |
+           ( (uint32_t)AesSbox[(w >> 16) & 0xff] << 16 ) |
+           ( (uint32_t)AesSbox[(w >> 8) & 0xff] << 8 ) |
+           ( (uint32_t)AesSbox[w & 0xff] );
+}
+
+/* One full round: column c takes the row r byte of column c + r */
+#define AES_ROUND(t, s, rk) do { \
+    (t)[0] = AesTe0[(s)[0] >> 24] ^ ROTR( AesTe0[((s)[1] >> 16) & 0xff], 8 ) ^ \
+             ROTR( AesTe0[((s)[2] >> 8) & 0xff], 16 ) ^ ROTR( AesTe0[(s)[3] & 0xff], 24 ) ^ GETU32( (rk) ); \
+    (t)[1] = AesTe0[(s)[1] >> 24] ^ ROTR( AesTe0[((s)[2] >> 16) & 0xff], 8 ) ^ \
+             ROTR( AesTe0[((s)[3] >> 8) & 0xff], 16 ) ^ ROTR( AesTe0[(s)[0] & 0xff], 24 ) ^ GETU32( (rk) + 4 ); \
+    (t)[2] = AesTe0[(s)[2] >> 24] ^ ROTR( AesTe0[((s)[3] >> 16) & 0xff], 8 ) ^ \
+             ROTR( AesTe0[((s)[0] >> 8) & 0xff], 16 ) ^ ROTR( AesTe0[(s)[1] & 0xff], 24 ) ^ GETU32( (rk) + 8 ); \
+    (t)[3] = AesTe0[(s)[3] >> 24] ^ ROTR( AesTe0[((s)[0] >> 16) & 0xff], 8 ) ^ \
+             ROTR( AesTe0[((s)[1] >> 8) & 0xff], 16 ) ^ ROTR( AesTe0[(s)[2] & 0xff], 24 ) ^ GETU32( (rk) + 12 ); \
+} while (0)
+
+/* Last round (no MixColumns) */
+#define AES_LAST(s, c, rk) \
+    ( ( ( (uint32_t)AesSbox[(s)[(c)] >> 24] << 24 ) | \
+        ( (uint32_t)AesSbox[((s)[((c) + 1) & 3] >> 16) & 0xff] << 16 ) | \
+        ( (uint32_t)AesSbox[((s)[((c) + 2) & 3] >> 8) & 0xff] << 8 ) | \
+        ( (uint32_t)AesSbox[(s)[((c) + 3) & 3] & 0xff] ) ) ^ GETU32( (rk) + 4 * (c) ) )
+
+/*
+ * Key cache entry: schedule and CMAC subkeys of an installed session key
+ * (owner = NULL: free entry)
+ */
+struct aes_key_el {
+    const void *owner;
+    uint8_t ksch[AES_KSCH_LEN];
+    uint8_t k1[N_BLOCK];
+    uint8_t k2[N_BLOCK];
+};
+
+#if MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN) > 0
+static struct aes_key_el AesKeyCache[MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN)];
+#endif
+
+/*
+ * Precomputed FRMPayload keystream of the next uplink:
+ * S_i = aes_encrypt(A_i), A_i = { 0x01, 0 x 4, Dir, DevAddr, FCnt, 0x00, i }
+ */
+#define AES_KS_COUNTER          ( N_BLOCK - 1 )
+
+#if MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS) > 0
+static struct {
+    bool valid;
+    uint8_t nb_blocks;
+    uint8_t key[AES_KEY_LEN];
+    uint8_t a[N_BLOCK];
+    uint8_t s[MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS)][N_BLOCK];
+} AesKeystream;
+#endif
+
+static void aes_expand_key( const uint8_t key[], uint8_t *rk )
+{
+    uint32_t w;
+    uint8_t i;
+
+    memcpy( rk, key, AES_KEY_LEN );
+    w = GETU32( rk + 12 );
+    for( i = 0; i < AES_ROUNDS; i++ ){
+        w = aes_sub_word( ROTR( w, 24 ) ) ^ ( (uint32_t)AesRcon[i] << 24 );
+        w ^= GETU32( rk );      PUTU32( rk + 16, w );
+        w ^= GETU32( rk + 4 );  PUTU32( rk + 20, w );
+        w ^= GETU32( rk + 8 );  PUTU32( rk + 24, w );
+        w ^= GETU32( rk + 12 ); PUTU32( rk + 28, w );
+        rk += 16;
+    }
+}
+
+/*
+ * Look for a key in the cache (the raw key is the first round key)
+ * return: the entry, NULL if not installed
+ */
+static struct aes_key_el * aes_key_cache_find( const uint8_t key[] )
+{
+#if MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN) > 0
+    uint8_t i;
+
+    for( i = 0; i < MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN); i++ ){
+        if( ( AesKeyCache[i].owner != NULL ) && ( memcmp( AesKeyCache[i].ksch, key, AES_KEY_LEN ) == 0 ) ){
+            return &AesKeyCache[i];
+        }
+    }
+#endif
+    return NULL;
+}
+
+return_type aes_set_key( const uint8_t key[], length_type keylen, aes_context ctx[1] )
+{
+    struct aes_key_el *el;
+    os_sr_t sr;
+
+    /* LoRaWAN only uses AES-128 */
+    if( keylen != AES_KEY_LEN ){
+        ctx->rnd = 0;
+        return (return_type)-1;
+    }
+
+    /* Installed session key: no expansion (the cache may be updated by another task) */
+    OS_ENTER_CRITICAL(sr);
+    el = aes_key_cache_find( key );
+    if( el != NULL ){
+        memcpy( ctx->ksch, el->ksch, AES_KSCH_LEN );
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if( el == NULL ){
+        aes_expand_key( key, ctx->ksch );
+    }
+    ctx->rnd = AES_ROUNDS;
+
+    return 0;
+}
+
+/*
+ * Look for an A_i block in the prepared keystream
+ * return: true if out is filled with S_i
+ */
+static bool aes_keystream_get( const aes_context *ctx, const uint8_t *in, uint8_t *out )
+{
+    bool found = false;
+#if MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS) > 0
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    if( AesKeystream.valid &&
+        ( in[AES_KS_COUNTER] >= 1 ) && ( in[AES_KS_COUNTER] <= AesKeystream.nb_blocks ) &&
+        ( memcmp( in, AesKeystream.a, AES_KS_COUNTER ) == 0 ) &&
+        ( memcmp( ctx->ksch, AesKeystream.key, AES_KEY_LEN ) == 0 ) ){
+        memcpy( out, AesKeystream.s[in[AES_KS_COUNTER] - 1], N_BLOCK );
+        found = true;
+    }
+    OS_EXIT_CRITICAL(sr);
+#endif
+    return found;
+}
+
+return_type aes_encrypt( const uint8_t in[N_BLOCK], uint8_t out[N_BLOCK], const aes_context ctx[1] )
+{
+    const uint8_t *rk = ctx->ksch;
+    aes_hw_encrypt_t hw = AesHwEncrypt;
+    uint32_t s[4];
+    uint32_t t[4];
+    uint8_t r;
+
+    if( ctx->rnd != AES_ROUNDS ){
+        return (return_type)-1;
+    }
+
+    /* Payload encryption of a prepared uplink: no block operation */
+    if( ( in[0] == 0x01 ) && aes_keystream_get( ctx, in, out ) ){
+        return 0;
+    }
+
+    if( ( hw != NULL ) && ( hw( ctx->ksch, in, out ) == 0 ) ){
+        return 0;
+    }
+
+    s[0] = GETU32( in ) ^ GETU32( rk );
+    s[1] = GETU32( in + 4 ) ^ GETU32( rk + 4 );
+    s[2] = GETU32( in + 8 ) ^ GETU32( rk + 8 );
+    s[3] = GETU32( in + 12 ) ^ GETU32( rk + 12 );
+
+    /* 2 rounds per iteration: no copy of the state */
+    for( r = 1; r < AES_ROUNDS - 1; r += 2 ){
+        AES_ROUND( t, s, rk + 16 * r );
+        AES_ROUND( s, t, rk + 16 * ( r + 1 ) );
+    }
+    AES_ROUND( t, s, rk + 16 * r );
+
+    rk += 16 * AES_ROUNDS;
+    s[0] = AES_LAST( t, 0, rk );
+    s[1] = AES_LAST( t, 1, rk );
+    s[2] = AES_LAST( t, 2, rk );
+    s[3] = AES_LAST( t, 3, rk );
+    PUTU32( out, s[0] );
+    PUTU32( out + 4, s[1] );
+    PUTU32( out + 8, s[2] );
+    PUTU32( out + 12, s[3] );
+
+    return 0;
+}
+
+void aes_cmac_shift(const uint8_t *in, uint8_t *out)
+{
+    uint8_t msb = in[0] & 0x80;
+    uint8_t i;
+
+    for( i = 0; i < N_BLOCK - 1; i++ ){
+        out[i] = (uint8_t)( ( in[i] << 1 ) | ( in[i + 1] >> 7 ) );
+    }
+    out[N_BLOCK - 1] = (uint8_t)( in[N_BLOCK - 1] << 1 );
+    if( msb ){
+        out[N_BLOCK - 1] ^= 0x87;
+    }
+}
+
+void aes_key_cache_set(const void *owner, const uint8_t *key)
+{
+#if MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN) > 0
+    struct aes_key_el el;
+    struct aes_key_el *free_el = NULL;
+    aes_context ctx;
+    uint8_t i;
+    os_sr_t sr;
+
+    /* Computed outside of the critical section */
+    if( key != NULL ){
+        el.owner = owner;
+        aes_expand_key( key, el.ksch );
+        memcpy( ctx.ksch, el.ksch, AES_KSCH_LEN );
+        ctx.rnd = AES_ROUNDS;
+        memset( el.k2, 0, N_BLOCK );
+        aes_encrypt( el.k2, el.k2, &ctx );
+        aes_cmac_shift( el.k2, el.k1 );
+        aes_cmac_shift( el.k1, el.k2 );
+        memset( &ctx, 0, sizeof( ctx ) );
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    for( i = 0; i < MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN); i++ ){
+        /* Rekey or removal: the previous key of the owner is dropped */
+        if( AesKeyCache[i].owner == owner ){
+            AesKeyCache[i].owner = NULL;
+        }
+        if( ( AesKeyCache[i].owner == NULL ) && ( free_el == NULL ) ){
+            free_el = &AesKeyCache[i];
+        }
+    }
+    /* Cache full: the key is expanded for each frame */
+    if( ( key != NULL ) && ( free_el != NULL ) ){
+        memcpy( free_el, &el, sizeof( el ) );
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if( key != NULL ){
+        memset( &el, 0, sizeof( el ) );
+    }
+#endif
+}
+
+bool aes_key_cache_subkeys(const uint8_t *key, uint8_t *k1, uint8_t *k2)
+{
+    struct aes_key_el *el;
+    os_sr_t sr;
+
+    OS_ENTER_CRITICAL(sr);
+    el = aes_key_cache_find( key );
+    if( el != NULL ){
+        memcpy( k1, el->k1, N_BLOCK );
+        memcpy( k2, el->k2, N_BLOCK );
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    return ( el != NULL );
+}
+
+void aes_keystream_prepare(const void *owner, uint32_t devAddr, uint32_t fcnt, uint8_t size)
+{
+#if ( MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN) > 0 ) && ( MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS) > 0 )
+    aes_context ctx;
+    uint8_t a[N_BLOCK];
+    uint8_t s[MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS)][N_BLOCK];
+    uint8_t nb_blocks;
+    uint8_t i;
+    bool found = false;
+    os_sr_t sr;
+
+    nb_blocks = ( size + N_BLOCK - 1 ) / N_BLOCK;
+    if( nb_blocks > MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS) ){
+        nb_blocks = MYNEWT_VAL(LORAWAN_KEYSTREAM_BLOCKS);
+    }
+
+    /* The previous keystream is for a sent frame */
+    OS_ENTER_CRITICAL(sr);
+    AesKeystream.valid = false;
+    for( i = 0; i < MYNEWT_VAL(LORAWAN_KEY_CACHE_LEN); i++ ){
+        if( AesKeyCache[i].owner == owner ){
+            memcpy( ctx.ksch, AesKeyCache[i].ksch, AES_KSCH_LEN );
+            found = true;
+            break;
+        }
+    }
+    OS_EXIT_CRITICAL(sr);
+
+    if( !found || ( nb_blocks == 0 ) ){
+        return;
+    }
+    ctx.rnd = AES_ROUNDS;
+
+    /* Uplink: Dir = 0 */
+    memset( a, 0, N_BLOCK );
+    a[0] = 0x01;
+    a[6] = devAddr & 0xFF;
+    a[7] = ( devAddr >> 8 ) & 0xFF;
+    a[8] = ( devAddr >> 16 ) & 0xFF;
+    a[9] = ( devAddr >> 24 ) & 0xFF;
+    a[10] = fcnt & 0xFF;
+    a[11] = ( fcnt >> 8 ) & 0xFF;
+    a[12] = ( fcnt >> 16 ) & 0xFF;
+    a[13] = ( fcnt >> 24 ) & 0xFF;
+
+    /* Computed outside of the critical section (the template is not published yet) */
+    for( i = 0; i < nb_blocks; i++ ){
+        a[AES_KS_COUNTER] = i + 1;
+        aes_encrypt( a, s[i], &ctx );
+    }
+
+    OS_ENTER_CRITICAL(sr);
+    memcpy( AesKeystream.key, ctx.ksch, AES_KEY_LEN );
+    memcpy( AesKeystream.a, a, N_BLOCK );
+    memcpy( AesKeystream.s, s, nb_blocks * N_BLOCK );
+    AesKeystream.nb_blocks = nb_blocks;
+    AesKeystream.valid = true;
+    OS_EXIT_CRITICAL(sr);
+
+    memset( &ctx, 0, sizeof( ctx ) );
+    memset( s, 0, sizeof( s ) );
+#endif
+}
+
+#else
+
+void aes_key_cache_set(const void *owner, const uint8_t *key)
+{
+}
+
+void aes_keystream_prepare(const void *owner, uint32_t devAddr, uint32_t fcnt, uint8_t size)
+{
+}
+
+#endif /* !MYNEWT_VAL(LORAWAN_CRYPTO_STOCK) */
@@ -0,0 +1,68 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * Integer time on air of the LoRa frames (no double arithmetic: soft-float on
+ * the MCUs without FPU), same formula as the radio drivers (SX1276 datasheet 4.1.1.7):
+ *   - Tsym = 2^SF / BW: an integer number of microseconds for the LoRaWAN
+ *     bandwidths (8 us << SF at 125kHz, halved at each bandwidth step),
+ *   - Tpreamble = ( Npreamble + 4.25 ) * Tsym,
+ *   - Npayload = 8 + max( ceil( ( 8PL - 4SF + 28 + 16CRC - 20IH ) / ( 4( SF - 2DE ) ) ) * ( CR + 4 ), 0 ).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "board-utils.h"
+
+/* Symbol time at 125kHz (in us), by SF */
+static const uint16_t LoraSymbolTime125[13] = {
+    8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768
+};
+
+uint32_t lora_time_on_air_us(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble,
+                             bool fixLen, bool crcOn, bool ldro, uint8_t pktLen)
+{
+    uint32_t tsym;
+    int32_t num;
+    int32_t den;
+    uint32_t nb_sym;
+
+    if( ( sf < 6 ) || ( sf > 12 ) || ( bw > 2 ) ){
+        return 0;
+    }
+    tsym = LoraSymbolTime125[sf] >> bw;
+
+    num = 8 * pktLen - 4 * sf + 28 + ( crcOn ? 16 : 0 ) - ( fixLen ? 20 : 0 );
+    den = 4 * ( sf - ( ldro ? 2 : 0 ) );
+    nb_sym = 8;
+    if( num > 0 ){
+        nb_sym += ( ( num + den - 1 ) / den ) * ( cr + 4 );
+    }
+
+    /* ( Npreamble + 4.25 ) * Tsym: exact, Tsym is a multiple of 4 us */
+    return ( ( 4 * (uint32_t)preamble + 17 ) * ( tsym / 4 ) ) + nb_sym * tsym;
+}
+
+uint32_t lora_time_on_air_ms(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble,
+                             bool fixLen, bool crcOn, bool ldro, uint8_t pktLen)
+{
+    /* Rounded up, as the radio drivers: floor( ms + 0.999 ) */
+    return ( lora_time_on_air_us( sf, bw, cr, preamble, fixLen, crcOn, ldro, pktLen ) + 999 ) / 1000;
+}
@@ -0,0 +1,127 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements.  See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership.  The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License.  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * AES-CMAC (RFC 4493) on top of the word-oriented AES of aes-board.c
+ * (replaces the cmac.c of the stack, same cmac.h interface).
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "syscfg/syscfg.h"
+
+#if !MYNEWT_VAL(LORAWAN_CRYPTO_STOCK)
+
+#include "aes.h"
+#include "cmac.h"
+#include "board-utils.h"
+
+#define CMAC_BLOCK              16
+
+/* dst ^= src (one block, by words: no alignment needed with memcpy) */
+static void cmac_xor(uint8_t *dst, const uint8_t *src)
+{
+    uint32_t d;
+    uint32_t w;
+    uint8_t i;
+
+    for( i = 0; i < CMAC_BLOCK; i += 4 ){
+        memcpy( &d, dst + i, 4 );
+        memcpy( &w, src + i, 4 );
+        d ^= w;
+        memcpy( dst + i, &d, 4 );
+    }
+}
+
+void AES_CMAC_Init(AES_CMAC_CTX *ctx)
+{
+    memset( ctx->X, 0, sizeof( ctx->X ) );
+    ctx->M_n = 0;
+}
+
+void AES_CMAC_SetKey(AES_CMAC_CTX *ctx, const uint8_t key[AES_CMAC_KEY_LENGTH])
+{
+    aes_set_key( key, AES_CMAC_KEY_LENGTH, &ctx->rijndael );
+}
+
+void AES_CMAC_Update(AES_CMAC_CTX *ctx, const uint8_t *data, uint32_t len)
+{
+    uint32_t mlen;
+
+    /* Complete the pending block (kept until more data is given: it may be the last one) */
+    if( ctx->M_n > 0 ){
+        mlen = CMAC_BLOCK - ctx->M_n;
+        if( mlen > len ){
+            mlen = len;
+        }
+        memcpy( ctx->M_last + ctx->M_n, data, mlen );
+        ctx->M_n += mlen;
+        if( ( ctx->M_n < CMAC_BLOCK ) || ( len == mlen ) ){
+            return;
+        }
+        cmac_xor( ctx->X, ctx->M_last );
+        aes_encrypt( ctx->X, ctx->X, &ctx->rijndael );
+        data += mlen;
+        len -= mlen;
+    }
+
+    /* Full blocks, except the last one */
+    while( len > CMAC_BLOCK ){
+        cmac_xor( ctx->X, data );
+        aes_encrypt( ctx->X, ctx->X, &ctx->rijndael );
+        data += CMAC_BLOCK;
+        len -= CMAC_BLOCK;
+    }
+
+    memcpy( ctx->M_last, data, len );
+    ctx->M_n = len;
+}
+
+void AES_CMAC_Final(uint8_t digest[AES_CMAC_DIGEST_LENGTH], AES_CMAC_CTX *ctx)
+{
+    uint8_t K1[CMAC_BLOCK];
+    uint8_t K2[CMAC_BLOCK];
+
+    /* Subkeys of the installed session keys are precomputed */
+    if( !aes_key_cache_subkeys( ctx->rijndael.ksch, K1, K2 ) ){
+        memset( K2, 0, sizeof( K2 ) );
+        aes_encrypt( K2, K2, &ctx->rijndael );
+        aes_cmac_shift( K2, K1 );
+        aes_cmac_shift( K1, K2 );
+    }
+
+    /* K1, or K2 for a padded last block */
+    if( ctx->M_n == CMAC_BLOCK ){
+        cmac_xor( ctx->M_last, K1 );
+    }
+    else {
+        ctx->M_last[ctx->M_n] = 0x80;
+        memset( ctx->M_last + ctx->M_n + 1, 0, CMAC_BLOCK - ctx->M_n - 1 );
+        cmac_xor( ctx->M_last, K2 );
+    }
+    cmac_xor( ctx->X, ctx->M_last );
+    aes_encrypt( ctx->X, digest, &ctx->rijndael );
+
+    memset( K1, 0, sizeof( K1 ) );
+    memset( K2, 0, sizeof( K2 ) );
+    memset( ctx, 0, sizeof( *ctx ) );
+}
+
+#endif /* !MYNEWT_VAL(LORAWAN_CRYPTO_STOCK) */
@@ -17,12 +17,29 @@
  * under the License.
  */
 
-#include "os/os_time.h"
+#include "os/os.h"
+#include "os/os_cputime.h"
 #include "delay-board.h"
 
+static void delay_timer_cb(void *arg)
+{
+    os_sem_release((struct os_sem *)arg);
+}
 
 void DelayMs( uint32_t ms )
 {
-    os_time_t current = os_time_get();
-    while( os_time_get() - current < ms );
+    struct hal_timer timer;
+    struct os_sem sem;
+
+    /* Before the scheduler starts, or in interrupt context: nothing else can run */
+    if( !os_started() || os_arch_in_isr() ){
+        os_cputime_delay_usecs(ms * 1000);
+        return;
+    }
+
+    /* Let the other tasks run (or the CPU sleep) until the hal timer fires */
+    os_sem_init(&sem, 0);
+    os_cputime_timer_init(&timer, delay_timer_cb, &sem);
+    os_cputime_timer_relative(&timer, ms * 1000);
+    os_sem_pend(&sem, OS_WAIT_FOREVER);
 }
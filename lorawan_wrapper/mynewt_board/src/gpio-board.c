@@ -21,6 +21,7 @@
 
 #include "bsp/bsp.h"
 #include "hal/hal_gpio.h"
+#include "os/os_cputime.h"
 
 #include "board-utils.h"
 #include "gpio-board.h"
@@ -29,28 +30,77 @@
 
 static GpioIrqHandler *GpioIrq[16] = { NULL };
 
-static void handler_wrapper (void *arg)
+#define GPIO_IRQ_RING_LEN   MYNEWT_VAL(LORAWAN_IRQ_RING_LEN)
+
+#if ( GPIO_IRQ_RING_LEN & ( GPIO_IRQ_RING_LEN - 1 ) ) != 0 || GPIO_IRQ_RING_LEN > 128
+#error "LORAWAN_IRQ_RING_LEN must be a power of 2 (up to 128)"
+#endif
+
+/*
+ * IRQ line: one static event posted to the LoRaWAN task, and the timestamps
+ * of the edges not handled yet (single producer: the ISR / single consumer: the task)
+ */
+struct gpio_irq_line {
+    struct os_event ev;
+    volatile uint8_t head;      /* written by the ISR only */
+    volatile uint8_t tail;      /* written by the task only */
+    uint32_t ts[GPIO_IRQ_RING_LEN];
+};
+
+static struct gpio_irq_line GpioIrqLine[16];
+static uint32_t GpioIrqOverflows = 0;
+
+/* Edge being handled by the LoRaWAN task */
+static bool GpioIrqActive = false;
+static uint32_t GpioIrqTimestamp;
+
+bool gpio_irq_timestamp_get(uint32_t *ts)
 {
-  uint32_t irqn = (uint32_t)arg;
-  if (GpioIrq[irqn] != NULL) {
-      GpioIrq[irqn]();
-  }
+    if (GpioIrqActive) {
+        *ts = GpioIrqTimestamp;
+    }
+    return GpioIrqActive;
 }
 
-//TODO: clean this wrapper
-static void wrapper(struct os_event *ev){
+uint32_t gpio_irq_overflows_get(void)
+{
+    return GpioIrqOverflows;
+}
 
-    handler_wrapper(ev->ev_arg);
-    free(ev);
+static void wrapper(struct os_event *ev){
+    struct gpio_irq_line *line = ev->ev_arg;
+    uint32_t irqn = line - GpioIrqLine;
+    uint8_t tail = line->tail;
+
+    /* Handle all the edges captured since the last run */
+    while (tail != line->head) {
+        GpioIrqTimestamp = line->ts[tail & (GPIO_IRQ_RING_LEN - 1)];
+        line->tail = ++tail;
+
+        GpioIrqActive = true;
+        if (GpioIrq[irqn] != NULL) {
+            GpioIrq[irqn]();
+        }
+        GpioIrqActive = false;
+    }
 }
 
 static void post_token(void *arg){
-    struct os_event *ev = malloc(sizeof(struct os_event));
-    assert(ev);
-    ev->ev_cb = wrapper;
-    ev->ev_arg = arg;
-    ev->ev_queued = 0;
-    os_eventq_put(os_eventq_lorawan_get(), ev);
+    struct gpio_irq_line *line = arg;
+    uint32_t ts = os_cputime_get32();
+    uint8_t head = line->head;
+
+    /* Keep the timestamp of the edge, unless all the slots are used */
+    if ((uint8_t)(head - line->tail) < GPIO_IRQ_RING_LEN) {
+        line->ts[head & (GPIO_IRQ_RING_LEN - 1)] = ts;
+        line->head = head + 1;
+    }
+    else {
+        GpioIrqOverflows++;
+    }
+
+    /* No effect if the event of the line is already queued */
+    os_eventq_put(os_eventq_lorawan_get(), &line->ev);
 }
 
 void GpioInit (Gpio_t *obj, PinNames pin, PinModes mode, PinConfigs config,
@@ -100,7 +150,11 @@ void GpioSetInterrupt (Gpio_t *obj, IrqModes irqMode,
         irqn = (obj->pin) & 0x0F;
         GpioIrq[irqn] = irqHandler;
 
-        hal_gpio_irq_init(obj->pin, post_token, (void *)irqn,
+        GpioIrqLine[irqn].ev.ev_cb = wrapper;
+        GpioIrqLine[irqn].ev.ev_arg = &GpioIrqLine[irqn];
+        GpioIrqLine[irqn].tail = GpioIrqLine[irqn].head;
+
+        hal_gpio_irq_init(obj->pin, post_token, &GpioIrqLine[irqn],
                           (hal_gpio_irq_trig_t)irqMode,
                           (hal_gpio_pull_t)obj->pull);
         hal_gpio_irq_enable(obj->pin);
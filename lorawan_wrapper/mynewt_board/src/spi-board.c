@@ -45,3 +45,25 @@ uint16_t SpiInOut( Spi_t *obj, uint16_t outData )
     return hal_spi_tx_val(obj->SpiId, outData);
 }
 
+void SpiInOutBuffer( Spi_t *obj, const uint8_t *txBuffer, uint8_t *rxBuffer, uint16_t size )
+{
+    int rc;
+
+    assert(obj);
+
+    /* Commands without parameters (e.g. SetFs) give a NULL buffer */
+    if (size == 0) {
+        return;
+    }
+
+    assert(txBuffer || rxBuffer);
+
+    if (txBuffer == NULL) {
+        /* Read only: clock out zeros from the Rx buffer itself */
+        memset(rxBuffer, 0, size);
+        txBuffer = rxBuffer;
+    }
+
+    rc = hal_spi_txrx(obj->SpiId, (void *)txBuffer, rxBuffer, size);
+    assert(rc == 0);
+}
@@ -26,7 +26,11 @@
 #include "board.h"
 #include "delay.h"
 #include "radio.h"
+#include "os/os.h"
+#include "os/os_cputime.h"
+#include "hal/hal_gpio.h"
 
+#include "board-utils.h"
 #include "sx126x-board.h"
 
 /*!
@@ -34,6 +38,109 @@
  */
 Gpio_t AntPow;
 
+/*!
+ * Write-through shadow of the configuration registers that the driver reads back
+ * (invalidated by reset and sleep; the OCP is also set by the SetPaConfig command)
+ */
+static const uint16_t ShadowAddr[] = {
+    0x0736,     // IQ polarity
+    0x0740,     // LoRa sync word (MSB)
+    0x0741,     // LoRa sync word (LSB)
+    0x0889,     // Tx modulation
+    0x08AC,     // Rx gain
+    0x08D8,     // Tx clamp config
+    0x08E7,     // OCP configuration
+};
+#define SHADOW_REG_OCP      6
+#define SHADOW_NB_REGS      ( sizeof( ShadowAddr ) / sizeof( ShadowAddr[0] ) )
+
+static uint8_t ShadowVal[SHADOW_NB_REGS];
+static uint16_t ShadowValid = 0;
+
+static int SX126xShadowIndex( uint16_t address )
+{
+    for( int i = 0; i < SHADOW_NB_REGS; i++ )
+    {
+        if( ShadowAddr[i] == address )
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*!
+ * Serve a read from the shadow, if all the registers are cached
+ */
+static bool SX126xShadowRead( uint16_t address, uint8_t *buffer, uint16_t size )
+{
+    int idx;
+
+    for( uint16_t i = 0; i < size; i++ )
+    {
+        idx = SX126xShadowIndex( address + i );
+        if( ( idx < 0 ) || ( ( ShadowValid & ( 1 << idx ) ) == 0 ) )
+        {
+            return false;
+        }
+    }
+    for( uint16_t i = 0; i < size; i++ )
+    {
+        buffer[i] = ShadowVal[SX126xShadowIndex( address + i )];
+    }
+    return true;
+}
+
+static void SX126xShadowUpdate( uint16_t address, const uint8_t *buffer, uint16_t size )
+{
+    int idx;
+
+    for( uint16_t i = 0; i < size; i++ )
+    {
+        idx = SX126xShadowIndex( address + i );
+        if( idx >= 0 )
+        {
+            ShadowVal[idx] = buffer[i];
+            ShadowValid |= ( 1 << idx );
+        }
+    }
+}
+
+static bool SX126xShadowEqual( uint16_t address, const uint8_t *buffer, uint16_t size )
+{
+    int idx;
+
+    for( uint16_t i = 0; i < size; i++ )
+    {
+        idx = SX126xShadowIndex( address + i );
+        if( ( idx < 0 ) || ( ( ShadowValid & ( 1 << idx ) ) == 0 ) || ( ShadowVal[idx] != buffer[i] ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * Released by the falling edge of the BUSY line
+ */
+static struct os_sem BusySem;
+
+/*!
+ * Commands whose BUSY line was not released in time (the radio doesn't answer)
+ */
+static uint32_t BusyTimeouts = 0;
+
+static void SX126xBusyIrq( void *arg )
+{
+    os_sem_release( &BusySem );
+}
+
+uint32_t radio_busy_timeouts_get( void )
+{
+    return BusyTimeouts;
+}
+
 void SX126xIoInit( void )
 {
     GpioInit( &SX126x.Spi.Nss, RADIO_NSS, PIN_OUTPUT, PIN_PUSH_PULL, PIN_PULL_UP, 1 );
@@ -41,6 +148,10 @@ void SX126xIoInit( void )
     GpioInit( &SX126x.DIO1, RADIO_DIO_1, PIN_INPUT, PIN_PUSH_PULL, PIN_NO_PULL, 0 );
     GpioInit( &SX126x.DIO2, RADIO_DIO_2, PIN_INPUT, PIN_PUSH_PULL, PIN_NO_PULL, 0 );
     GpioInit( &SX126x.DIO3, RADIO_DIO_3, PIN_INPUT, PIN_PUSH_PULL, PIN_NO_PULL, 0 );
+
+    /* BUSY falling edge interrupt: only enabled while SX126xWaitOnBusy sleeps */
+    os_sem_init( &BusySem, 0 );
+    hal_gpio_irq_init( RADIO_BUSY, SX126xBusyIrq, NULL, HAL_GPIO_TRIG_FALLING, HAL_GPIO_PULL_NONE );
 }
 
 void SX126xIoIrqInit( DioIrqHandler dioIrq )
@@ -64,6 +175,9 @@ uint32_t SX126xGetBoardTcxoWakeupTime( void )
 
 void SX126xReset( void )
 {
+    // The registers go back to their default values
+    ShadowValid = 0;
+
     DelayMs( 10 );
     GpioInit( &SX126x.Reset, RADIO_RESET, PIN_OUTPUT, PIN_PUSH_PULL, PIN_NO_PULL, 0 );
     DelayMs( 20 );
@@ -73,7 +187,52 @@ void SX126xReset( void )
 
 void SX126xWaitOnBusy( void )
 {
-    while( GpioRead( &SX126x.BUSY ) == 1 );
+    uint32_t start;
+    uint32_t spin = os_cputime_usecs_to_ticks( MYNEWT_VAL(SX126X_BUSY_SPIN_US) );
+    uint32_t timeout = os_cputime_usecs_to_ticks( MYNEWT_VAL(SX126X_BUSY_TIMEOUT_MS) * 1000 );
+    os_time_t deadline;
+    os_time_t now;
+
+    start = os_cputime_get32( );
+
+    /* After most commands, BUSY is released within a few us: spin first */
+    while( GpioRead( &SX126x.BUSY ) == 1 ){
+        if( ( os_cputime_get32( ) - start ) >= spin ){
+            break;
+        }
+    }
+    if( GpioRead( &SX126x.BUSY ) == 0 ){
+        return;
+    }
+
+    /* Nothing else can run: keep polling, up to the timeout */
+    if( !os_started( ) || os_arch_in_isr( ) ){
+        while( GpioRead( &SX126x.BUSY ) == 1 ){
+            if( ( os_cputime_get32( ) - start ) >= timeout ){
+                BusyTimeouts++;
+                return;
+            }
+        }
+        return;
+    }
+
+    /* Drop the tokens of the previous edges: only the edge of this command may wake up the task */
+    while( os_sem_pend( &BusySem, 0 ) == OS_OK );
+
+    /* Sleep until the falling edge, up to one deadline for the whole wait
+     * (the line is checked again after the enable: the edge may be already passed) */
+    deadline = os_time_get( ) + os_time_ms_to_ticks32( MYNEWT_VAL(SX126X_BUSY_TIMEOUT_MS) ) + 1;
+    hal_gpio_irq_enable( RADIO_BUSY );
+    while( GpioRead( &SX126x.BUSY ) == 1 ){
+        now = os_time_get( );
+        if( (int32_t)( deadline - now ) <= 0 ){
+            // The radio doesn't answer: the command is lost, the MAC recovers on its Tx/Rx timeouts
+            BusyTimeouts++;
+            break;
+        }
+        os_sem_pend( &BusySem, deadline - now );
+    }
+    hal_gpio_irq_disable( RADIO_BUSY );
 }
 
 void SX126xWakeup( void )
@@ -95,16 +254,23 @@ void SX126xWakeup( void )
 
 void SX126xWriteCommand( RadioCommands_t command, uint8_t *buffer, uint16_t size )
 {
+    if( command == RADIO_SET_SLEEP )
+    {
+        // The registers are lost in cold start sleep
+        ShadowValid = 0;
+    }
+    else if( command == RADIO_SET_PACONFIG )
+    {
+        // The OCP is set by the PA configuration
+        ShadowValid &= ~( 1 << SHADOW_REG_OCP );
+    }
+
     SX126xCheckDeviceReady( );
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
 
     SpiInOut( &SX126x.Spi, ( uint8_t )command );
-
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        SpiInOut( &SX126x.Spi, buffer[i] );
-    }
+    SpiInOutBuffer( &SX126x.Spi, buffer, NULL, size );
 
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
@@ -120,12 +286,10 @@ void SX126xReadCommand( RadioCommands_t command, uint8_t *buffer, uint16_t size
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
 
-    SpiInOut( &SX126x.Spi, ( uint8_t )command );
-    SpiInOut( &SX126x.Spi, 0x00 );
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        buffer[i] = SpiInOut( &SX126x.Spi, 0 );
-    }
+    uint8_t header[2] = { ( uint8_t )command, 0x00 };
+
+    SpiInOutBuffer( &SX126x.Spi, header, NULL, sizeof( header ) );
+    SpiInOutBuffer( &SX126x.Spi, NULL, buffer, size );
 
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
@@ -134,18 +298,21 @@ void SX126xReadCommand( RadioCommands_t command, uint8_t *buffer, uint16_t size
 
 void SX126xWriteRegisters( uint16_t address, uint8_t *buffer, uint16_t size )
 {
+    // Same value already in the radio
+    if( SX126xShadowEqual( address, buffer, size ) )
+    {
+        return;
+    }
+    SX126xShadowUpdate( address, buffer, size );
+
     SX126xCheckDeviceReady( );
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
     
-    SpiInOut( &SX126x.Spi, RADIO_WRITE_REGISTER );
-    SpiInOut( &SX126x.Spi, ( address & 0xFF00 ) >> 8 );
-    SpiInOut( &SX126x.Spi, address & 0x00FF );
-    
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        SpiInOut( &SX126x.Spi, buffer[i] );
-    }
+    uint8_t header[3] = { RADIO_WRITE_REGISTER, ( address & 0xFF00 ) >> 8, address & 0x00FF };
+
+    SpiInOutBuffer( &SX126x.Spi, header, NULL, sizeof( header ) );
+    SpiInOutBuffer( &SX126x.Spi, buffer, NULL, size );
 
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
@@ -159,21 +326,24 @@ void SX126xWriteRegister( uint16_t address, uint8_t value )
 
 void SX126xReadRegisters( uint16_t address, uint8_t *buffer, uint16_t size )
 {
+    if( SX126xShadowRead( address, buffer, size ) )
+    {
+        return;
+    }
+
     SX126xCheckDeviceReady( );
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
 
-    SpiInOut( &SX126x.Spi, RADIO_READ_REGISTER );
-    SpiInOut( &SX126x.Spi, ( address & 0xFF00 ) >> 8 );
-    SpiInOut( &SX126x.Spi, address & 0x00FF );
-    SpiInOut( &SX126x.Spi, 0 );
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        buffer[i] = SpiInOut( &SX126x.Spi, 0 );
-    }
+    uint8_t header[4] = { RADIO_READ_REGISTER, ( address & 0xFF00 ) >> 8, address & 0x00FF, 0 };
+
+    SpiInOutBuffer( &SX126x.Spi, header, NULL, sizeof( header ) );
+    SpiInOutBuffer( &SX126x.Spi, NULL, buffer, size );
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
     SX126xWaitOnBusy( );
+
+    SX126xShadowUpdate( address, buffer, size );
 }
 
 uint8_t SX126xReadRegister( uint16_t address )
@@ -189,12 +359,11 @@ void SX126xWriteBuffer( uint8_t offset, uint8_t *buffer, uint8_t size )
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
 
-    SpiInOut( &SX126x.Spi, RADIO_WRITE_BUFFER );
-    SpiInOut( &SX126x.Spi, offset );
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        SpiInOut( &SX126x.Spi, buffer[i] );
-    }
+    uint8_t header[2] = { RADIO_WRITE_BUFFER, offset };
+
+    SpiInOutBuffer( &SX126x.Spi, header, NULL, sizeof( header ) );
+    SpiInOutBuffer( &SX126x.Spi, buffer, NULL, size );
+
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
     SX126xWaitOnBusy( );
@@ -206,13 +375,10 @@ void SX126xReadBuffer( uint8_t offset, uint8_t *buffer, uint8_t size )
 
     GpioWrite( &SX126x.Spi.Nss, 0 );
 
-    SpiInOut( &SX126x.Spi, RADIO_READ_BUFFER );
-    SpiInOut( &SX126x.Spi, offset );
-    SpiInOut( &SX126x.Spi, 0 );
-    for( uint16_t i = 0; i < size; i++ )
-    {
-        buffer[i] = SpiInOut( &SX126x.Spi, 0 );
-    }
+    uint8_t header[3] = { RADIO_READ_BUFFER, offset, 0 };
+
+    SpiInOutBuffer( &SX126x.Spi, header, NULL, sizeof( header ) );
+    SpiInOutBuffer( &SX126x.Spi, NULL, buffer, size );
     GpioWrite( &SX126x.Spi.Nss, 1 );
 
     SX126xWaitOnBusy( );
@@ -27,12 +27,33 @@
 #include "radio.h"
 
 #include "sx1272-board.h"
+#include "board-utils.h"
 
 /*!
  * Flag used to set the RF switch control pins in low power mode when the radio is not active.
  */
 static bool RadioIsActive = false;
 
+/*!
+ * \brief Computes the packet time on air in ms (integer arithmetic for LoRa, see lora_time_on_air_ms)
+ *
+ * \param [IN] modem      Radio modem to be used [0: FSK, 1: LoRa]
+ * \param [IN] pktLen     Packet payload length
+ * \retval airTime        Computed airTime (ms) for the given packet payload length
+ */
+static uint32_t SX1272BoardGetTimeOnAir( RadioModems_t modem, uint8_t pktLen )
+{
+    if( modem != MODEM_LORA ){
+        return SX1272GetTimeOnAir( modem, pktLen );
+    }
+
+    /* Bandwidth: 0 = 125kHz .. 2 = 500kHz */
+    return lora_time_on_air_ms( SX1272.Settings.LoRa.Datarate, SX1272.Settings.LoRa.Bandwidth,
+                                SX1272.Settings.LoRa.Coderate, SX1272.Settings.LoRa.PreambleLen,
+                                SX1272.Settings.LoRa.FixLen, SX1272.Settings.LoRa.CrcOn,
+                                SX1272.Settings.LoRa.LowDatarateOptimize, pktLen );
+}
+
 /*!
  * Radio driver structure initialization
  */
@@ -47,7 +68,7 @@ const struct Radio_s Radio =
     SX1272SetRxConfig,
     SX1272SetTxConfig,
     SX1272CheckRfFrequency,
-    SX1272GetTimeOnAir,
+    SX1272BoardGetTimeOnAir,
     SX1272Send,
     SX1272SetSleep,
     SX1272SetStby,
@@ -64,6 +85,15 @@ const struct Radio_s Radio =
     SX1272GetWakeupTime
 };
 
+/*!
+ * Shadow of the PA registers: only written by SX1272SetRfTxPower, invalidated by SX1272Reset
+ */
+static struct {
+    bool valid;
+    uint8_t paConfig;
+    uint8_t paDac;
+} PaShadow = { false, 0, 0 };
+
 /*!
  * Antenna switch GPIO pins objects
  */
@@ -131,6 +161,9 @@ uint32_t SX1272GetBoardTcxoWakeupTime( void )
 
 void SX1272Reset( void )
 {
+    // The registers go back to their default values
+    PaShadow.valid = false;
+
     // Enables the TCXO if available on the board design
     SX1272SetBoardTcxo( true );
 
@@ -152,8 +185,15 @@ void SX1272SetRfTxPower( int8_t power )
     uint8_t paConfig = 0;
     uint8_t paDac = 0;
 
-    paConfig = SX1272Read( REG_PACONFIG );
-    paDac = SX1272Read( REG_PADAC );
+    // Read the registers only once after a reset
+    if( PaShadow.valid == false )
+    {
+        PaShadow.paConfig = SX1272Read( REG_PACONFIG );
+        PaShadow.paDac = SX1272Read( REG_PADAC );
+        PaShadow.valid = true;
+    }
+    paConfig = PaShadow.paConfig;
+    paDac = PaShadow.paDac;
 
     paConfig = ( paConfig & RF_PACONFIG_PASELECT_MASK ) | SX1272GetPaSelect( SX1272.Settings.Channel );
 
@@ -204,8 +244,17 @@ void SX1272SetRfTxPower( int8_t power )
         }
         paConfig = ( paConfig & RFLR_PACONFIG_OUTPUTPOWER_MASK ) | ( uint8_t )( ( uint16_t )( power + 1 ) & 0x0F );
     }
-    SX1272Write( REG_PACONFIG, paConfig );
-    SX1272Write( REG_PADAC, paDac );
+    // Write only the registers which change
+    if( paConfig != PaShadow.paConfig )
+    {
+        SX1272Write( REG_PACONFIG, paConfig );
+        PaShadow.paConfig = paConfig;
+    }
+    if( paDac != PaShadow.paDac )
+    {
+        SX1272Write( REG_PADAC, paDac );
+        PaShadow.paDac = paDac;
+    }
 }
 
 uint8_t SX1272GetPaSelect( uint32_t channel )
@@ -27,12 +27,33 @@
 #include "radio.h"
 
 #include "sx1276-board.h"
+#include "board-utils.h"
 
 /*!
  * Flag used to set the RF switch control pins in low power mode when the radio is not active.
  */
 static bool RadioIsActive = false;
 
+/*!
+ * \brief Computes the packet time on air in ms (integer arithmetic for LoRa, see lora_time_on_air_ms)
+ *
+ * \param [IN] modem      Radio modem to be used [0: FSK, 1: LoRa]
+ * \param [IN] pktLen     Packet payload length
+ * \retval airTime        Computed airTime (ms) for the given packet payload length
+ */
+static uint32_t SX1276BoardGetTimeOnAir( RadioModems_t modem, uint8_t pktLen )
+{
+    if( modem != MODEM_LORA ){
+        return SX1276GetTimeOnAir( modem, pktLen );
+    }
+
+    /* Bandwidth (stored as 7..9 by SX1276SetTxConfig): 0 = 125kHz .. 2 = 500kHz */
+    return lora_time_on_air_ms( SX1276.Settings.LoRa.Datarate, SX1276.Settings.LoRa.Bandwidth - 7,
+                                SX1276.Settings.LoRa.Coderate, SX1276.Settings.LoRa.PreambleLen,
+                                SX1276.Settings.LoRa.FixLen, SX1276.Settings.LoRa.CrcOn,
+                                SX1276.Settings.LoRa.LowDatarateOptimize, pktLen );
+}
+
 /*!
  * Radio driver structure initialization
  */
@@ -47,7 +68,7 @@ const struct Radio_s Radio =
     SX1276SetRxConfig,
     SX1276SetTxConfig,
     SX1276CheckRfFrequency,
-    SX1276GetTimeOnAir,
+    SX1276BoardGetTimeOnAir,
     SX1276Send,
     SX1276SetSleep,
     SX1276SetStby,
@@ -64,6 +85,15 @@ const struct Radio_s Radio =
     SX1276GetWakeupTime
 };
 
+/*!
+ * Shadow of the PA registers: only written by SX1276SetRfTxPower, invalidated by SX1276Reset
+ */
+static struct {
+    bool valid;
+    uint8_t paConfig;
+    uint8_t paDac;
+} PaShadow = { false, 0, 0 };
+
 /*!
  * Antenna switch GPIO pins objects
  */
@@ -131,6 +161,9 @@ uint32_t SX1276GetBoardTcxoWakeupTime( void )
 
 void SX1276Reset( void )
 {
+    // The registers go back to their default values
+    PaShadow.valid = false;
+
     // Enables the TCXO if available on the board design
     SX1276SetBoardTcxo( true );
 
@@ -152,8 +185,15 @@ void SX1276SetRfTxPower( int8_t power )
     uint8_t paConfig = 0;
     uint8_t paDac = 0;
 
-    paConfig = SX1276Read( REG_PACONFIG );
-    paDac = SX1276Read( REG_PADAC );
+    // Read the registers only once after a reset
+    if( PaShadow.valid == false )
+    {
+        PaShadow.paConfig = SX1276Read( REG_PACONFIG );
+        PaShadow.paDac = SX1276Read( REG_PADAC );
+        PaShadow.valid = true;
+    }
+    paConfig = PaShadow.paConfig;
+    paDac = PaShadow.paDac;
 
     paConfig = ( paConfig & RF_PACONFIG_PASELECT_MASK ) | SX1276GetPaSelect( SX1276.Settings.Channel );
     paConfig = ( paConfig & RF_PACONFIG_MAX_POWER_MASK ) | 0x70;
@@ -205,8 +245,17 @@ void SX1276SetRfTxPower( int8_t power )
         }
         paConfig = ( paConfig & RF_PACONFIG_OUTPUTPOWER_MASK ) | ( uint8_t )( ( uint16_t )( power + 1 ) & 0x0F );
     }
-    SX1276Write( REG_PACONFIG, paConfig );
-    SX1276Write( REG_PADAC, paDac );
+    // Write only the registers which change
+    if( paConfig != PaShadow.paConfig )
+    {
+        SX1276Write( REG_PACONFIG, paConfig );
+        PaShadow.paConfig = paConfig;
+    }
+    if( paDac != PaShadow.paDac )
+    {
+        SX1276Write( REG_PADAC, paDac );
+        PaShadow.paDac = paDac;
+    }
 }
 
 uint8_t SX1276GetPaSelect( uint32_t channel )
@@ -20,48 +20,139 @@
 #include <assert.h>
 #include <string.h>
 
+#include "syscfg/syscfg.h"
+#include "os/os_cputime.h"
 #include "timer.h"
 
+#include "board-utils.h"
 #include "queue-board.h"
 
 /*!
- * Timers list structure definition
+ * Wrap period of the 32 bits cputime (about 4295s at 1MHz, 268s at 16MHz)
  */
-struct tim_list {
-    struct os_callout *os_tim;
+#define TIM_WRAP_US             ( ( ( 1ULL << 32 ) * 1000000ULL ) / MYNEWT_VAL(OS_CPUTIME_FREQ) )
+
+/*!
+ * Longest delay given to a hal_timer at once (longer timeouts are re-armed):
+ * half the wrap, so that the delay in cputime ticks fits in 32 bits
+ */
+#define TIM_CHUNK_US            ( ( TIM_WRAP_US / 2 < ( 1UL << 30 ) ) ? TIM_WRAP_US / 2 : ( 1UL << 30 ) )
+
+/*!
+ * Period of the timebase refresh: at most half the wrap of the 32 bits cputime
+ */
+#define TIM_REFRESH_SEC         ( ( TIM_WRAP_US / 2000000 < 600 ) ? TIM_WRAP_US / 2000000 : 600 )
+
+#if TIM_WRAP_US / 2000000 == 0
+#error "OS_CPUTIME_FREQ is too high for the timebase refresh"
+#endif
+
+/*!
+ * Timer slot structure definition: bound to its TimerEvent_t through obj->Next
+ * (the chain list of TimerEvent_t is not used by this implementation)
+ */
+struct tim_slot {
+    struct hal_timer hal_tim;   /* fires in interrupt context */
+    struct os_event ev;         /* posted to the LoRaWAN task on expiry */
+    uint64_t deadline_us;
     TimerEvent_t *obj;
-    SLIST_ENTRY(tim_list) sc_next;
 };
 
 /*!
- * Timers list head pointer
+ * Timer slots (a timer is never released)
+ */
+static struct tim_slot l_tim_slots[MYNEWT_VAL(LORAWAN_TIMER_MAX)];
+static uint16_t l_tim_used = 0;
+
+/*!
+ * 64 bits extension of the cputime
  */
-static SLIST_HEAD(, tim_list) l_tim_list =
-    SLIST_HEAD_INITIALIZER();
+static uint32_t tim_last_cputime = 0;
+static uint64_t tim_high_cputime = 0;
+static struct os_callout tim_refresh;
+static bool tim_refresh_init = false;
 
+void timer_slots_get(uint16_t *total, uint16_t *used)
+{
+    *total = MYNEWT_VAL(LORAWAN_TIMER_MAX);
+    *used = l_tim_used;
+}
 
-static struct tim_list * _find_Timer_el(TimerEvent_t *obj)
+/*!
+ * \brief Read the monotonic timebase (must be called at least once per wrap of the cputime)
+ *
+ * \retval time in microseconds since boot
+ */
+uint64_t timer_get_us64(void)
 {
-    struct tim_list *i_list;
+    uint32_t now;
+    uint64_t ticks;
+    os_sr_t sr;
 
-    /* Find the matching element */
-    for ( i_list=SLIST_FIRST(&l_tim_list); i_list != NULL;  i_list=SLIST_NEXT(i_list, sc_next) ){
-        if(i_list->obj == obj)
-            break;
+    OS_ENTER_CRITICAL(sr);
+    now = os_cputime_get32();
+    if (now < tim_last_cputime) {
+        tim_high_cputime += (1ULL << 32);
     }
-    /* No timer found - exit */
-    assert(i_list != NULL);
+    tim_last_cputime = now;
+    ticks = tim_high_cputime | now;
+    OS_EXIT_CRITICAL(sr);
 
-    return i_list;
+    /* Split to avoid the overflow of the product */
+    return (ticks / MYNEWT_VAL(OS_CPUTIME_FREQ)) * 1000000ULL +
+           ((ticks % MYNEWT_VAL(OS_CPUTIME_FREQ)) * 1000000ULL) / MYNEWT_VAL(OS_CPUTIME_FREQ);
 }
 
+static void tim_refresh_cb(struct os_event *ev)
+{
+    timer_get_us64();
+    os_callout_reset(&tim_refresh, TIM_REFRESH_SEC * OS_TICKS_PER_SEC);
+}
+
+static struct tim_slot * _get_Timer_el(TimerEvent_t *obj)
+{
+    struct tim_slot *el = (struct tim_slot *)obj->Next;
+
+    /* Not initialized by TimerInit */
+    assert(el != NULL);
+
+    return el;
+}
 
 /*!
- * Timer IRQ event handler
+ * Arm the hal_timer of the slot for its deadline (by chunks for the long timeouts)
+ */
+static void _arm_Timer_el(struct tim_slot *el, uint64_t now_us)
+{
+    uint64_t remaining = el->deadline_us - now_us;
+
+    os_cputime_timer_relative(&el->hal_tim, (remaining > TIM_CHUNK_US) ? TIM_CHUNK_US : (uint32_t)remaining);
+}
+
+/*!
+ * Timer IRQ handler (interrupt context)
+ */
+static void hal_wrapper(void *arg)
+{
+    struct tim_slot *el = arg;
+    uint64_t now_us = timer_get_us64();
+
+    if (now_us < el->deadline_us) {
+        _arm_Timer_el(el, now_us);
+    }
+    else {
+        os_eventq_put(os_eventq_lorawan_get(), &el->ev);
+    }
+}
+
+/*!
+ * Timer event handler (LoRaWAN task)
  */
-typedef void (*fn_void) (void);
 static void wrapper(struct os_event *ev){
-    ((fn_void)ev->ev_arg)();
+    struct tim_slot *el = ev->ev_arg;
+
+    el->obj->IsRunning = false;
+    el->obj->Callback();
 }
 
 /*!
@@ -75,36 +166,37 @@ static void wrapper(struct os_event *ev){
  */
 void TimerInit( TimerEvent_t *obj, void ( *callback )( void ) )
 {
-    struct tim_list* sc;
-    struct os_callout *os_callout;
-
-    //TODO: fix the wile(1) error
-    /* Check if the timer is not already into the list */
-    for ( sc=SLIST_FIRST(&l_tim_list); sc != NULL;  sc=SLIST_NEXT(sc, sc_next) ){
-        if(sc->obj == obj)
-            while(1);
-    }
-
+    struct tim_slot *el = (struct tim_slot *)obj->Next;
 
-    /* allocate one element on the list */
-    sc = malloc( sizeof(struct tim_list) );
-    assert(sc);
+    /* Keep the 64 bits timebase up to date, even without running timers */
+    if (!tim_refresh_init) {
+        tim_refresh_init = true;
+        os_callout_init(&tim_refresh, os_eventq_lorawan_get(), tim_refresh_cb, NULL);
+        os_callout_reset(&tim_refresh, TIM_REFRESH_SEC * OS_TICKS_PER_SEC);
+    }
 
-    /* allocate one OS callout timer */
-    os_callout = malloc( sizeof(struct os_callout) );
-    assert(os_callout);
+    /* Already initialized: reuse its slot */
+    if ( ( el >= &l_tim_slots[0] ) && ( el < &l_tim_slots[l_tim_used] ) && ( el->obj == obj ) ){
+        os_cputime_timer_stop(&el->hal_tim);
+        os_eventq_remove(os_eventq_lorawan_get(), &el->ev);
+    }
+    else {
+        /* take one free slot (with its hal timer) */
+        assert(l_tim_used < MYNEWT_VAL(LORAWAN_TIMER_MAX));
+        el = &l_tim_slots[l_tim_used++];
+        el->obj = obj;
+    }
 
-    sc->os_tim = os_callout;
-    sc->obj = obj;
+    os_cputime_timer_init(&el->hal_tim, hal_wrapper, el);
+    el->ev.ev_cb = wrapper;
+    el->ev.ev_arg = el;
 
     /* Initialize the TimerEvent_t object */
     obj->Timestamp = 0;
     obj->ReloadValue = 0;
     obj->IsRunning = false;
     obj->Callback = callback;
-    obj->Next = NULL; //Chain list of TimerEvent_t is not used
-
-    SLIST_INSERT_HEAD(&l_tim_list, sc, sc_next);
+    obj->Next = (struct TimerEvent_s *)el; //Chain list of TimerEvent_t is not used: it points to the slot
 }
 
 /*!
@@ -117,10 +209,21 @@ void TimerStart( TimerEvent_t *obj )
     if(obj->IsRunning == true){
         TimerStop(obj);
     }
-    struct tim_list *el = _find_Timer_el(obj);
-    os_callout_init( el->os_tim, os_eventq_lorawan_get(), wrapper, el->obj->Callback);
-    os_callout_reset(el->os_tim, el->obj->ReloadValue);
+    struct tim_slot *el = _get_Timer_el(obj);
+    uint64_t start_us = timer_get_us64();
+    uint32_t elapsed;
+    uint32_t ts;
+
+    /* Started from a radio IRQ handler (e.g. Rx windows after TxDone):
+     * count the timeout from the IRQ edge, not from the time the task got scheduled */
+    if (gpio_irq_timestamp_get(&ts)) {
+        elapsed = os_cputime_ticks_to_usecs(os_cputime_get32() - ts);
+        start_us = (start_us > elapsed) ? (start_us - elapsed) : 0;
+    }
+
     obj->IsRunning = true;
+    el->deadline_us = start_us + (uint64_t)obj->ReloadValue * 1000;
+    hal_wrapper(el);
 }
 
 /*!
@@ -130,9 +233,11 @@ void TimerStart( TimerEvent_t *obj )
  */
 void TimerStop( TimerEvent_t *obj )
 {
-    struct tim_list *el = _find_Timer_el(obj);
+    struct tim_slot *el = _get_Timer_el(obj);
     if(obj->IsRunning == true){
-        os_callout_stop(el->os_tim);
+        os_cputime_timer_stop(&el->hal_tim);
+        /* Already expired, but not handled yet */
+        os_eventq_remove(os_eventq_lorawan_get(), &el->ev);
         obj->IsRunning = false;
     }
 }
@@ -145,13 +250,11 @@ void TimerStop( TimerEvent_t *obj )
  */
 void TimerSetValue( TimerEvent_t *obj, uint32_t value )
 {
-    struct tim_list *el = _find_Timer_el(obj);
-
     if(obj->IsRunning == true){
         TimerStop(obj);
     }
 
-    el->obj->ReloadValue = value; //in msec
+    obj->ReloadValue = value; //in msec
 }
 
 /*!
@@ -168,23 +271,21 @@ void TimerReset( TimerEvent_t *obj )
 /*!
  * \brief Read the current time
  *
- * \retval time returns current time
+ * \retval time returns current time (in msec, wraps after 49 days)
  */
 TimerTime_t TimerGetCurrentTime( void )
 {
-    //TODO: manage clock update case
-    return os_time_get();
+    return (TimerTime_t)(timer_get_us64() / 1000);
 }
 
 /*!
  * \brief Return the Time elapsed since a fix moment in Time
  *
  * \param [IN] savedTime    fix moment in Time
- * \retval time             returns elapsed time
+ * \retval time             returns elapsed time (in msec)
  */
 TimerTime_t TimerGetElapsedTime( TimerTime_t savedTime )
 {
-    //TODO: manage clock update case
-    return (os_time_get() - savedTime);
+    /* Unsigned arithmetic: correct across the wrap of the msec counter */
+    return (TimerGetCurrentTime() - savedTime);
 }
-